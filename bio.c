@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a set of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -17,6 +17,20 @@
 // * B_VALID: the buffer data has been read from the disk.
 // * B_DIRTY: the buffer data has been modified
 //     and needs to be written to disk.
+//
+// Buffers are found through a hash table on (dev, blockno),
+// each bucket with its own lock, so lookups of different
+// blocks do not contend.  A bucket's lock protects its chain
+// and the refcnt of the buffers on it.  Buffers with refcnt 0
+// are also on an LRU list, under bcache.lrulock, from which
+// a miss takes the least recently used one to recycle.
+// Buffers come from a slab cache: a miss allocates a new one
+// while the cache is below its limit, and bshrink() frees
+// unreferenced ones when memory runs low.
+// Misses recycle one at a time under bcache.lock, so that two
+// of them cannot give the same block two buffers.  Locks are
+// taken in the order bcache.lock, a bucket lock, bcache.lrulock,
+// and never two bucket locks at once.
 
 #include "types.h"
 #include "defs.h"
@@ -25,34 +39,174 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "memstat.h"
+
+#define NBUCKET 127
+#define BHASH(dev, blockno) (((dev) * 131 + (blockno)) % NBUCKET)
 
 struct {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct spinlock lrulock;
+  struct slabcache *cache;     // where buffers come from
+  int nbuf;                    // buffers allocated
+  int maxbuf;                  // most the cache grows to
+  int nfree;                   // buffers on the LRU list
+
+  // Linked list of unreferenced buffers, through prev/next.
+  // lru.next is most recently used.
+  struct buf lru;
 
-  // Linked list of all buffers, through prev/next.
-  // head.next is most recently used.
-  struct buf head;
+  struct {
+    struct spinlock lock;
+    struct buf *head;          // chain through hnext
+  } bucket[NBUCKET];
 } bcache;
 
+// Allocate a new buffer, or return 0 if the cache is at its limit
+// or memory is low.  Caller holds bcache.lock, or is binit().
+static struct buf*
+balloc(void)
+{
+  struct buf *b;
+
+  if(bcache.nbuf >= bcache.maxbuf ||
+     (bcache.nbuf >= NBUF && kfreepercent() < LOWMEM_PCT))
+    return 0;
+  if((b = slaballoc(bcache.cache)) == 0)
+    return 0;
+  memset(b, 0, sizeof(*b));
+  initsleeplock(&b->lock, "buffer");
+  bcache.nbuf++;
+  return b;
+}
+
+// The cache starts with the NBUF buffers that the log needs.  It
+// grows to BCACHE_PCT percent of RAM, but never past one buffer per
+// file system block.
 void
 binit(void)
 {
   struct buf *b;
+  int i;
 
   initlock(&bcache.lock, "bcache");
+  initlock(&bcache.lrulock, "bcache.lru");
+  for(i = 0; i < NBUCKET; i++)
+    initlock(&bcache.bucket[i].lock, "bcache.bucket");
+  bcache.cache = slabcreate("buf", sizeof(struct buf), MT_BCACHE);
+  bcache.maxbuf = physend / 100 * BCACHE_PCT / BSIZE;
+  if(bcache.maxbuf > FSSIZE)
+    bcache.maxbuf = FSSIZE;
+  if(bcache.maxbuf < NBUF)
+    bcache.maxbuf = NBUF;
 
 //PAGEBREAK!
   // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  bcache.lru.prev = &bcache.lru;
+  bcache.lru.next = &bcache.lru;
+  for(i = 0; i < NBUF; i++){
+    if((b = balloc()) == 0)
+      panic("binit");
+    b->next = bcache.lru.next;
+    b->prev = &bcache.lru;
+    bcache.lru.next->prev = b;
+    bcache.lru.next = b;
+    bcache.nfree++;
+  }
+}
+
+static void bput(struct buf*);
+
+// Unlink b from the LRU list.  Caller holds bcache.lrulock.
+static void
+lrudel(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+  bcache.nfree--;
+}
+
+// Look for the block in bucket h and take a reference to it.
+// Caller holds the bucket's lock.
+static struct buf*
+bfind(uint h, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bcache.bucket[h].head; b; b = b->hnext){
+    if(b->dev == dev && b->blockno == blockno){
+      if(b->refcnt++ == 0){
+        acquire(&bcache.lrulock);
+        lrudel(b);
+        release(&bcache.lrulock);
+      }
+      return b;
+    }
+  }
+  return 0;
+}
+
+// Take the least recently used clean buffer off the LRU list and
+// out of its bucket, or return 0 if every buffer is in use.
+// Caller holds bcache.lock.
+static struct buf*
+bvictim(void)
+{
+  struct buf *b, **pp;
+  uint oh;
+
+  for(;;){
+    // Even if refcnt==0, B_DIRTY indicates a buffer is in use
+    // because log.c has modified it but not yet committed it.
+    acquire(&bcache.lrulock);
+    for(b = bcache.lru.prev; b != &bcache.lru; b = b->prev)
+      if((b->flags & B_DIRTY) == 0)
+        break;
+    release(&bcache.lrulock);
+    if(b == &bcache.lru)
+      return 0;
+
+    // Only bcache.lock holders change b->dev and b->blockno,
+    // but a lookup may have taken b since the LRU list was read.
+    oh = BHASH(b->dev, b->blockno);
+    acquire(&bcache.bucket[oh].lock);
+    if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0)
+      break;
+    release(&bcache.bucket[oh].lock);
+  }
+  acquire(&bcache.lrulock);
+  lrudel(b);
+  release(&bcache.lrulock);
+  for(pp = &bcache.bucket[oh].head; *pp; pp = &(*pp)->hnext){
+    if(*pp == b){
+      *pp = b->hnext;
+      break;
+    }
   }
+  release(&bcache.bucket[oh].lock);
+  return b;
+}
+
+// Get a buffer for block blockno on dev, new or recycled, and put
+// it in bucket h with one reference.  Returns 0 if every buffer is
+// in use.  Caller holds bcache.lock.
+static struct buf*
+brecycle(uint h, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  if((b = balloc()) == 0 && (b = bvictim()) == 0)
+    return 0;
+  b->dev = dev;
+  b->blockno = blockno;
+  b->flags = 0;
+  b->refcnt = 1;
+
+  acquire(&bcache.bucket[h].lock);
+  b->hnext = bcache.bucket[h].head;
+  bcache.bucket[h].head = b;
+  release(&bcache.bucket[h].lock);
+  return b;
 }
 
 // Look through buffer cache for block on device dev.
@@ -62,34 +216,46 @@ static struct buf*
 bget(uint dev, uint blockno)
 {
   struct buf *b;
+  uint h;
 
-  acquire(&bcache.lock);
+  h = BHASH(dev, blockno);
+  acquire(&bcache.bucket[h].lock);
+  b = bfind(h, dev, blockno);
+  release(&bcache.bucket[h].lock);
 
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  if(b == 0){
+    // Not cached.  Look again under bcache.lock, in case another
+    // miss brought the block in meanwhile, then recycle a buffer.
+    acquire(&bcache.lock);
+    acquire(&bcache.bucket[h].lock);
+    b = bfind(h, dev, blockno);
+    release(&bcache.bucket[h].lock);
+    if(b == 0 && (b = brecycle(h, dev, blockno)) == 0)
+      panic("bget: no buffers");
+    release(&bcache.lock);
   }
+  acquiresleep(&b->lock);
+  return b;
+}
 
-  // Not cached; recycle an unused buffer.
-  // Even if refcnt==0, B_DIRTY indicates a buffer is in use
-  // because log.c has modified it but not yet committed it.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->flags = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+// Free up to n unreferenced buffers, keeping the NBUF that the log
+// needs.  Called by kswapd when memory is low.  Returns the number
+// freed.
+int
+bshrink(int n)
+{
+  struct buf *b;
+  int i;
+
+  acquire(&bcache.lock);
+  for(i = 0; i < n && bcache.nbuf > NBUF; i++){
+    if((b = bvictim()) == 0)
+      break;
+    slabfree(bcache.cache, b);
+    bcache.nbuf--;
   }
-  panic("bget: no buffers");
+  release(&bcache.lock);
+  return i;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -105,6 +271,56 @@ bread(uint dev, uint blockno)
   return b;
 }
 
+// Is block blockno on dev in bucket h?
+static int
+bcached(uint h, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  acquire(&bcache.bucket[h].lock);
+  for(b = bcache.bucket[h].head; b; b = b->hnext)
+    if(b->dev == dev && b->blockno == blockno)
+      break;
+  release(&bcache.bucket[h].lock);
+  return b != 0;
+}
+
+// Start reading a block that the caller expects to need soon and
+// return without waiting for it.  Does nothing if the block is
+// already cached, or if fewer than NBUF/2 buffers are free or could
+// still be allocated: readahead must not push out blocks that are
+// in use to make room for ones that may never be read.  The disk
+// driver hands the buffer to bdone() once the data is in.
+void
+breadahead(uint dev, uint blockno)
+{
+  struct buf *b;
+  uint h;
+
+  // An unlocked look; a wrong guess costs only a wasted or a
+  // skipped read.
+  if(bcache.nfree + bcache.maxbuf - bcache.nbuf < NBUF/2)
+    return;
+  h = BHASH(dev, blockno);
+  if(bcached(h, dev, blockno))
+    return;
+  acquire(&bcache.lock);
+  if(bcached(h, dev, blockno) || (b = brecycle(h, dev, blockno)) == 0){
+    release(&bcache.lock);
+    return;
+  }
+  release(&bcache.lock);
+
+  // A bread() of the block may have got in first.
+  acquiresleep(&b->lock);
+  if(b->flags & B_VALID){
+    brelse(b);
+    return;
+  }
+  b->flags |= B_ASYNC;
+  idereadasync(b);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -116,28 +332,48 @@ bwrite(struct buf *b)
 }
 
 // Release a locked buffer.
-// Move to the head of the MRU list.
+// Once unreferenced, move to the head of the LRU list.
 void
 brelse(struct buf *b)
 {
   if(!holdingsleep(&b->lock))
     panic("brelse");
+  bput(b);
+}
+
+// Release b once the read that breadahead() started is done, on
+// behalf of the process that started it.  Called by the disk
+// driver, possibly from its interrupt handler.
+void
+bdone(struct buf *b)
+{
+  b->flags &= ~B_ASYNC;
+  bput(b);
+}
+
+// Unlock b and drop a reference to it.
+static void
+bput(struct buf *b)
+{
+  uint h;
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  h = BHASH(b->dev, b->blockno);
+  acquire(&bcache.bucket[h].lock);
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    acquire(&bcache.lrulock);
+    b->next = bcache.lru.next;
+    b->prev = &bcache.lru;
+    bcache.lru.next->prev = b;
+    bcache.lru.next = b;
+    bcache.nfree++;
+    release(&bcache.lrulock);
   }
   
-  release(&bcache.lock);
+  release(&bcache.bucket[h].lock);
 }
 //PAGEBREAK!
 // Blank page.
@@ -5,6 +5,10 @@ struct inode;
 struct pipe;
 struct proc;
 struct rtcdate;
+struct slabcache;
+struct memstat;
+struct emptyPages;
+struct swpdPages;
 struct spinlock;
 struct sleeplock;
 struct stat;
@@ -14,6 +18,9 @@ struct superblock;
 void            binit(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
+void            breadahead(uint, uint);
+void            bdone(struct buf*);
+int             bshrink(int);
 void            bwrite(struct buf*);
 
 // console.c
@@ -43,6 +50,7 @@ struct inode*   idup(struct inode*);
 void            iinit(int dev);
 void            ilock(struct inode*);
 void            iput(struct inode*);
+int             ishrink(int);
 void            iunlock(struct inode*);
 void            iunlockput(struct inode*);
 void            iupdate(struct inode*);
@@ -62,6 +70,7 @@ int             removeSwapFile(struct proc* p);
 void            ideinit(void);
 void            ideintr(void);
 void            iderw(struct buf*);
+void            idereadasync(struct buf*);
 
 // ioapic.c
 void            ioapicenable(int irq, int cpu);
@@ -69,19 +78,33 @@ extern uchar    ioapicid;
 void            ioapicinit(void);
 
 // kalloc.c
+extern uint     physend;
 char*           kalloc(void);
+char*           kalloczeroed(void);
+void            frametag(char*, int);
+void            kmemstat(struct memstat*);
+void            zeropoolfill(void);
 void            kfree(char*);
+char*           kallocpages(int);
+void            kfreepages(char*, int);
 void            kinit1(void*, void*);
 void            kinit2(void*, void*);
+int             kfreepercent(void);
+void            frameset(uint, pde_t*, uint);
+pde_t*          frameowner(uint, uint*);
+void            frameref(uint);
+int             framerefs(uint);
 
 // kbd.c
 void            kbdintr(void);
 
 // lapic.c
 void            cmostime(struct rtcdate *r);
+uint            cmos_read(uint);
 int             lapicid(void);
 extern volatile uint*    lapic;
 void            lapiceoi(void);
+void            lapicipi(int, int);
 void            lapicinit(void);
 void            lapicstartap(uchar, uint);
 void            microdelay(int);
@@ -101,6 +124,7 @@ void            picenable(int);
 void            picinit(void);
 
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, char*, int);
@@ -108,11 +132,17 @@ int             pipewrite(struct pipe*, char*, int);
 
 //PAGEBREAK: 16
 // proc.c
+int             allocPageMeta(struct proc*);
+void            freePageMeta(struct emptyPages*, struct swpdPages*);
 int             cpuid(void);
 void            exit(void);
 int             fork(void);
 int             growproc(int);
 int             kill(int);
+void            kswapdinit(void);
+void            loadctlfault(void);
+int             oomkill(void);
+int             mempressurewait(int);
 struct cpu*     mycpu(void);
 struct proc*    myproc();
 void            pinit(void);
@@ -121,6 +151,7 @@ void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            setproc(struct proc*);
 void            sleep(void*, struct spinlock*);
+void            suspend(void);
 void            userinit(void);
 int             wait(void);
 void            wakeup(void*);
@@ -143,6 +174,11 @@ void            release(struct spinlock*);
 void            pushcli(void);
 void            popcli(void);
 
+// slab.c
+struct slabcache* slabcreate(char*, uint, int);
+void*           slaballoc(struct slabcache*);
+void            slabfree(struct slabcache*, void*);
+
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
@@ -192,10 +228,22 @@ void            inituvm(pde_t*, char*, uint);
 int             loaduvm(pde_t*, char*, struct inode*, uint, uint);
 pde_t*          copyuvm(pde_t*, uint);
 void            switchuvm(struct proc*);
+void            resumeuvm(struct proc*);
 void            switchkvm(void);
+int             countpgtabs(pde_t*);
+int             pageFault(uint, int);
+int             uvmresident(uint, uint);
+int             ksmScan(struct proc*, int);
+void            pgeinit(void);
+void            tlbshootdown(pde_t*, uint);
 int             copyout(pde_t*, uint, void*, uint);
 void            clearpteu(pde_t *pgdir, char *uva);
-void            swapPages(uint);
+int             swapOutAll(void);
+int             swapOutProc(struct proc*);
+int             swapInProc(struct proc*);
+int             madvise(uint, uint, int);
+int             mlock(uint, uint);
+int             munlock(uint, uint);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
@@ -23,6 +23,8 @@ exec(char *path, char **argv)
   int pagesInSwapFile = 0;
   struct emptyPages *head = 0;
   struct emptyPages *tail = 0;
+  struct emptyPages *pagesFreedARR = 0;
+  struct swpdPages *pagesSwappedARR = 0;
 
   begin_op();
 
@@ -48,19 +50,12 @@ exec(char *path, char **argv)
     cprintf("EXEC:(proc = %s)- backing up page info \n", curproc->name);
   pagesInPhyMem = curproc->pagesInPhyMem;
   pagesInSwapFile = curproc->pagesInSwapFile;
-  struct emptyPages pagesFreedARR[MAX_PSYC_PAGES];
-  struct swpdPages pagesSwappedARR[MAX_PSYC_PAGES];
-  for (i = 0; i < MAX_PSYC_PAGES; i++) {
-    pagesFreedARR[i].virtualAddress = curproc->pagesFreedARR[i].virtualAddress;
-    curproc->pagesFreedARR[i].virtualAddress = (char*)0xffffffff;
-    pagesFreedARR[i].next = curproc->pagesFreedARR[i].next;
-    curproc->pagesFreedARR[i].next = 0;
-    pagesFreedARR[i].prev = curproc->pagesFreedARR[i].prev;
-    curproc->pagesFreedARR[i].prev = 0;
-    pagesSwappedARR[i].virtualAddress = curproc->pagesSwappedARR[i].virtualAddress;
-    curproc->pagesSwappedARR[i].virtualAddress = (char*)0xffffffff;
-    pagesSwappedARR[i].swaploc = curproc->pagesSwappedARR[i].swaploc;
-    curproc->pagesSwappedARR[i].swaploc = 0;
+  pagesFreedARR = curproc->pagesFreedARR;
+  pagesSwappedARR = curproc->pagesSwappedARR;
+  if(allocPageMeta(curproc) < 0){
+    pagesFreedARR = 0;
+    pagesSwappedARR = 0;
+    goto bad;
   }
   head = curproc->head;
   tail = curproc->tail;
@@ -127,17 +122,28 @@ exec(char *path, char **argv)
   safestrcpy(curproc->name, last, sizeof(curproc->name));
 
   // Commit to the user image.
+  // The old image's paged-out page tables die with it: forget their
+  // slots, whose swap file space goes when the file is recreated below.
+  for(i = 0; i < MAX_SWAP_PGTABS; i++)
+    curproc->pgtabSwapped[i] = -1;
   oldpgdir = curproc->pgdir;
   curproc->pgdir = pgdir;
   curproc->sz = sz;
   curproc->tf->eip = elf.entry;  // main
   curproc->tf->esp = sp;
+  memset(curproc->madv, 0, sizeof(curproc->madv));
+  curproc->pagesPinned = 0;
   // a swap file has been created in fork(), but its content was of the
   // parent process, and is no longer relevant.
   removeSwapFile(curproc);
-  createSwapFile(curproc);
+  if(createSwapFile(curproc) < 0){
+    // Too late to fail the exec; the new image cannot page.
+    cprintf("exec: pid %d: no swap file\n", curproc->pid);
+    curproc->killed = 1;
+  }
   switchuvm(curproc);
   freevm(oldpgdir);
+  freePageMeta(pagesFreedARR, pagesSwappedARR);
   return 0;
 
  bad:
@@ -147,17 +153,14 @@ exec(char *path, char **argv)
     iunlockput(ip);
     end_op();
   }
-  curproc->pagesInPhyMem = pagesInPhyMem;
-  curproc->pagesInSwapFile = pagesInSwapFile;
-
-  curproc->head = head;
-  curproc->tail = tail;
-  for (i = 0; i < MAX_PSYC_PAGES; i++) {
-    curproc->pagesFreedARR[i].virtualAddress = pagesFreedARR[i].virtualAddress;
-    curproc->pagesFreedARR[i].next = pagesFreedARR[i].next;
-    curproc->pagesFreedARR[i].prev = pagesFreedARR[i].prev;
-    curproc->pagesSwappedARR[i].virtualAddress = pagesSwappedARR[i].virtualAddress;
-    curproc->pagesSwappedARR[i].swaploc = pagesSwappedARR[i].swaploc;
+  if(pagesFreedARR){
+    curproc->pagesInPhyMem = pagesInPhyMem;
+    curproc->pagesInSwapFile = pagesInSwapFile;
+    curproc->head = head;
+    curproc->tail = tail;
+    freePageMeta(curproc->pagesFreedARR, curproc->pagesSwappedARR);
+    curproc->pagesFreedARR = pagesFreedARR;
+    curproc->pagesSwappedARR = pagesSwappedARR;
   }
   return -1;
 }
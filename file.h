@@ -14,8 +14,14 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *next; // Next entry in icache.list
+  struct inode *lruprev; // LRU list of unreferenced entries
+  struct inode *lrunext;
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
+  uint ranext;        // block after the last one read (readahead)
+  uint raend;         // block after the last one read ahead
+  int swapfile;       // a process's swap file: no readahead
 
   short type;         // copy of disk inode
   short major;
@@ -20,6 +20,7 @@
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
+#include "memstat.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 static void itrunc(struct inode*);
@@ -120,12 +121,12 @@ bfree(int dev, uint b)
 //   is non-zero. ialloc() allocates, and iput() frees if
 //   the reference and link counts have fallen to zero.
 //
-// * Referencing in cache: an entry in the inode cache
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
+// * Referencing in cache: ip->ref tracks the number of
+//   in-memory pointers to an inode cache entry (open
 //   files and current directories). iget() finds or
 //   creates a cache entry and increments its ref; iput()
-//   decrements ref.
+//   decrements ref, and frees the entry when ref reaches
+//   zero.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   cache entry is only correct when ip->valid is 1.
@@ -155,10 +156,14 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The icache.lock spin-lock protects the allocation of icache
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold icache.lock while using any of those fields.
+// The icache.lock spin-lock protects icache.list, which holds
+// every cached entry; entries are allocated from icache.slab.
+// An entry whose ip->ref drops to 0 stays cached on the
+// icache.lru list too, and is only freed by ishrink() when
+// memory runs low.  Since ip->ref decides when an entry can be
+// freed, and ip->dev and ip->inum indicate which i-node an entry
+// holds, one must hold icache.lock while using any of those
+// fields.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
@@ -166,18 +171,21 @@ bfree(int dev, uint b)
 
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct slabcache *slab;
+  struct inode *list;
+
+  // Linked list of unreferenced entries, through lruprev/lrunext.
+  // lru.lrunext is most recently used.
+  struct inode lru;
 } icache;
 
 void
 iinit(int dev)
 {
-  int i = 0;
-  
   initlock(&icache.lock, "icache");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&icache.inode[i].lock, "inode");
-  }
+  icache.slab = slabcreate("inode", sizeof(struct inode), MT_SLAB);
+  icache.lru.lruprev = &icache.lru;
+  icache.lru.lrunext = &icache.lru;
 
   readsb(dev, &sb);
   cprintf("sb: size %d nblocks %d ninodes %d nlog %d logstart %d\
@@ -191,23 +199,29 @@ static struct inode* iget(uint dev, uint inum);
 //PAGEBREAK!
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
-// Returns an unlocked but allocated and referenced inode.
+// Returns an unlocked but allocated and referenced inode,
+// or 0 if there is no memory for its cache entry.
 struct inode*
 ialloc(uint dev, short type)
 {
   int inum;
   struct buf *bp;
   struct dinode *dip;
+  struct inode *ip;
 
   for(inum = 1; inum < sb.ninodes; inum++){
     bp = bread(dev, IBLOCK(inum, sb));
     dip = (struct dinode*)bp->data + inum%IPB;
     if(dip->type == 0){  // a free inode
+      if((ip = iget(dev, inum)) == 0){
+        brelse(bp);
+        return 0;
+      }
       memset(dip, 0, sizeof(*dip));
       dip->type = type;
       log_write(bp);   // mark it allocated on the disk
       brelse(bp);
-      return iget(dev, inum);
+      return ip;
     }
     brelse(bp);
   }
@@ -236,37 +250,63 @@ iupdate(struct inode *ip)
   brelse(bp);
 }
 
+// Take an unreferenced entry off icache.lru and icache.list.
+// Caller must hold icache.lock.
+static struct inode*
+iunlink(struct inode *ip)
+{
+  struct inode **pp;
+
+  ip->lruprev->lrunext = ip->lrunext;
+  ip->lrunext->lruprev = ip->lruprev;
+  for(pp = &icache.list; *pp != ip; pp = &(*pp)->next)
+    ;
+  *pp = ip->next;
+  return ip;
+}
+
 // Find the inode with number inum on device dev
 // and return the in-memory copy. Does not lock
 // the inode and does not read it from disk.
+// Returns 0 if there is no memory for a new entry.
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip;
 
   acquire(&icache.lock);
 
   // Is the inode already cached?
-  empty = 0;
-  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
+  for(ip = icache.list; ip; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref++ == 0){
+        ip->lruprev->lrunext = ip->lrunext;
+        ip->lrunext->lruprev = ip->lruprev;
+      }
       release(&icache.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode cache entry.
-  if(empty == 0)
-    panic("iget: no inodes");
-
-  ip = empty;
+  // Allocate an inode cache entry, or recycle the least recently
+  // used unreferenced one if there is no memory.
+  if((ip = slaballoc(icache.slab)) == 0){
+    if(icache.lru.lruprev == &icache.lru){
+      release(&icache.lock);
+      return 0;
+    }
+    ip = iunlink(icache.lru.lruprev);
+  }
+  initsleeplock(&ip->lock, "inode");
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->ranext = 0;
+  ip->raend = 0;
+  ip->swapfile = 0;
+  ip->next = icache.list;
+  icache.list = ip;
   release(&icache.lock);
 
   return ip;
@@ -323,8 +363,8 @@ iunlock(struct inode *ip)
 }
 
 // Drop a reference to an in-memory inode.
-// If that was the last reference, the inode cache entry can
-// be recycled.
+// If that was the last reference, the inode cache entry goes
+// on the LRU list, for ishrink() to free.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -343,13 +383,34 @@ iput(struct inode *ip)
       ip->type = 0;
       iupdate(ip);
       ip->valid = 0;
+      ip->swapfile = 0;
     }
   }
   releasesleep(&ip->lock);
 
   acquire(&icache.lock);
-  ip->ref--;
+  if(--ip->ref == 0){
+    ip->lrunext = icache.lru.lrunext;
+    ip->lruprev = &icache.lru;
+    icache.lru.lrunext->lruprev = ip;
+    icache.lru.lrunext = ip;
+  }
+  release(&icache.lock);
+}
+
+// Free up to n unreferenced inode cache entries, least recently
+// used first.  Called by kswapd when memory is low.  Returns the
+// number freed.
+int
+ishrink(int n)
+{
+  int i;
+
+  acquire(&icache.lock);
+  for(i = 0; i < n && icache.lru.lruprev != &icache.lru; i++)
+    slabfree(icache.slab, iunlink(icache.lru.lruprev));
   release(&icache.lock);
+  return i;
 }
 
 // Common idiom: unlock, then put.
@@ -369,15 +430,16 @@ iunlockput(struct inode *ip)
 // listed in block ip->addrs[NDIRECT].
 
 // Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// If there is no such block, bmap allocates one if alloc is set
+// and returns 0 if not.
 static uint
-bmap(struct inode *ip, uint bn)
+bmap(struct inode *ip, uint bn, int alloc)
 {
   uint addr, *a;
   struct buf *bp;
 
   if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0)
+    if((addr = ip->addrs[bn]) == 0 && alloc)
       ip->addrs[bn] = addr = balloc(ip->dev);
     return addr;
   }
@@ -385,11 +447,14 @@ bmap(struct inode *ip, uint bn)
 
   if(bn < NINDIRECT){
     // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0)
+    if((addr = ip->addrs[NDIRECT]) == 0){
+      if(!alloc)
+        return 0;
       ip->addrs[NDIRECT] = addr = balloc(ip->dev);
+    }
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
+    if((addr = a[bn]) == 0 && alloc){
       a[bn] = addr = balloc(ip->dev);
       log_write(bp);
     }
@@ -447,13 +512,42 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// A read of blocks start up to (not including) end has finished.
+// If it carried on from where the last read of ip stopped, start
+// reading the READAHEAD blocks after end, so that they are cached
+// by the time the reader gets to them.  Blocks already started are
+// not asked for again.  Caller must hold ip->lock.
+static void
+readahead(struct inode *ip, uint start, uint end)
+{
+  uint bn, last, addr;
+
+  // A read that ends in the middle of a block is followed by one
+  // that starts in that same block.
+  if(start != ip->ranext && start + 1 != ip->ranext){
+    ip->ranext = end;
+    ip->raend = end;
+    return;
+  }
+  ip->ranext = end;
+  last = end + READAHEAD;
+  if(last > (ip->size + BSIZE - 1) / BSIZE)
+    last = (ip->size + BSIZE - 1) / BSIZE;
+  for(bn = ip->raend > end ? ip->raend : end; bn < last; bn++){
+    if((addr = bmap(ip, bn, 0)) != 0)
+      breadahead(ip->dev, addr);
+  }
+  if(bn > ip->raend)
+    ip->raend = bn;
+}
+
 //PAGEBREAK!
 // Read data from inode.
 // Caller must hold ip->lock.
 int
 readi(struct inode *ip, char *dst, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, start;
   struct buf *bp;
 
   if(ip->type == T_DEV){
@@ -467,12 +561,15 @@ readi(struct inode *ip, char *dst, uint off, uint n)
   if(off + n > ip->size)
     n = ip->size - off;
 
+  start = off/BSIZE;
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
+    bp = bread(ip->dev, bmap(ip, off/BSIZE, 1));
     m = min(n - tot, BSIZE - off%BSIZE);
     memmove(dst, bp->data + off%BSIZE, m);
     brelse(bp);
   }
+  if(n > 0 && !ip->swapfile)
+    readahead(ip, start, (off - 1)/BSIZE + 1);
   return n;
 }
 
@@ -497,7 +594,7 @@ writei(struct inode *ip, char *src, uint off, uint n)
     return -1;
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
+    bp = bread(ip->dev, bmap(ip, off/BSIZE, 1));
     m = min(n - tot, BSIZE - off%BSIZE);
     memmove(bp->data + off%BSIZE, src, m);
     log_write(bp);
@@ -521,11 +618,12 @@ namecmp(const char *s, const char *t)
 }
 
 // Look for a directory entry in a directory.
-// If found, set *poff to byte offset of entry.
-struct inode*
-dirlookup(struct inode *dp, char *name, uint *poff)
+// If found, set *poff to byte offset of entry and
+// return its inode number; otherwise return 0.
+static uint
+dirfind(struct inode *dp, char *name, uint *poff)
 {
-  uint off, inum;
+  uint off;
   struct dirent de;
 
   if(dp->type != T_DIR)
@@ -540,27 +638,37 @@ dirlookup(struct inode *dp, char *name, uint *poff)
       // entry matches path element
       if(poff)
         *poff = off;
-      inum = de.inum;
-      return iget(dp->dev, inum);
+      return de.inum;
     }
   }
 
   return 0;
 }
 
+// Look for a directory entry in a directory.
+// If found, set *poff to byte offset of entry.
+// Returns 0 if not found, or if there is no
+// memory for the inode's cache entry.
+struct inode*
+dirlookup(struct inode *dp, char *name, uint *poff)
+{
+  uint inum;
+
+  if((inum = dirfind(dp, name, poff)) == 0)
+    return 0;
+  return iget(dp->dev, inum);
+}
+
 // Write a new directory entry (name, inum) into the directory dp.
 int
 dirlink(struct inode *dp, char *name, uint inum)
 {
   int off;
   struct dirent de;
-  struct inode *ip;
 
   // Check that name is not present.
-  if((ip = dirlookup(dp, name, 0)) != 0){
-    iput(ip);
+  if(dirfind(dp, name, 0) != 0)
     return -1;
-  }
 
   // Look for an empty dirent.
   for(off = 0; off < dp->size; off += sizeof(de)){
@@ -627,9 +735,10 @@ namex(char *path, int nameiparent, char *name)
 {
   struct inode *ip, *next;
 
-  if(*path == '/')
-    ip = iget(ROOTDEV, ROOTINO);
-  else
+  if(*path == '/'){
+    if((ip = iget(ROOTDEV, ROOTINO)) == 0)
+      return 0;
+  } else
     ip = idup(myproc()->cwd);
 
   while((path = skipelem(path, name)) != 0){
@@ -714,6 +823,7 @@ removeSwapFile(struct proc* p)
 		return -1;
 	}
 	fileclose(p->swapFile);
+	p->swapFile = 0;
 
 	begin_op();
 	if((dp = nameiparent(path, name)) == 0)
@@ -775,11 +885,21 @@ createSwapFile(struct proc* p)
 
     begin_op();
     struct inode * in = create(path, T_FILE, 0, 0);
+	if (in == 0) {
+		end_op();
+		return -1;
+	}
+	// Paging reads the swap file a slot at a time, in no useful order.
+	in->swapfile = 1;
 	iunlock(in);
 
 	p->swapFile = filealloc();
-	if (p->swapFile == 0)
-		panic("no slot for files on /store");
+	if (p->swapFile == 0) {
+		// The file stays; create() hands it back to the next try.
+		iput(in);
+		end_op();
+		return -1;
+	}
 
 	p->swapFile->ip = in;
 	p->swapFile->type = FD_INODE;
@@ -792,21 +912,30 @@ createSwapFile(struct proc* p)
 }
 
 //return as sys_write (-1 when error)
+//p->pagingio is held up while the transfer may sleep, so that KSM and
+//kswapd leave alone the frames the paging code is holding on to.
 int
 writeToSwapFile(struct proc * p, char* buffer, uint placeOnFile, uint size)
 {
-	p->swapFile->off = placeOnFile;
-
-	return filewrite(p->swapFile, buffer, size);
+	int r;
 
+	p->pagingio++;
+	p->swapFile->off = placeOnFile;
+	r = filewrite(p->swapFile, buffer, size);
+	p->pagingio--;
+	return r;
 }
 
 //return as sys_read (-1 when error)
 int
 readFromSwapFile(struct proc * p, char* buffer, uint placeOnFile, uint size)
 {
-	p->swapFile->off = placeOnFile;
+	int r;
 
-	return fileread(p->swapFile, buffer,  size);
+	p->pagingio++;
+	p->swapFile->off = placeOnFile;
+	r = fileread(p->swapFile, buffer,  size);
+	p->pagingio--;
+	return r;
 }
 
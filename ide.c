@@ -104,6 +104,7 @@ void
 ideintr(void)
 {
   struct buf *b;
+  int async;
 
   // First queued buffer is the active request.
   acquire(&idelock);
@@ -121,13 +122,37 @@ ideintr(void)
   // Wake process waiting for this buf.
   b->flags |= B_VALID;
   b->flags &= ~B_DIRTY;
-  wakeup(b);
+  async = b->flags & B_ASYNC;
+  if(!async)
+    wakeup(b);
 
   // Start disk on next buf in queue.
   if(idequeue != 0)
     idestart(idequeue);
 
   release(&idelock);
+
+  // No one is waiting for a read ahead; release it for its owner.
+  if(async)
+    bdone(b);
+}
+
+// Append b to idequeue and start the disk if it is idle.
+// Caller must hold idelock.
+static void
+ideenqueue(struct buf *b)
+{
+  struct buf **pp;
+
+  // Append b to idequeue.
+  b->qnext = 0;
+  for(pp=&idequeue; *pp; pp=&(*pp)->qnext)  //DOC:insert-queue
+    ;
+  *pp = b;
+
+  // Start disk if necessary.
+  if(idequeue == b)
+    idestart(b);
 }
 
 //PAGEBREAK!
@@ -137,8 +162,6 @@ ideintr(void)
 void
 iderw(struct buf *b)
 {
-  struct buf **pp;
-
   if(!holdingsleep(&b->lock))
     panic("iderw: buf not locked");
   if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
@@ -148,15 +171,7 @@ iderw(struct buf *b)
 
   acquire(&idelock);  //DOC:acquire-lock
 
-  // Append b to idequeue.
-  b->qnext = 0;
-  for(pp=&idequeue; *pp; pp=&(*pp)->qnext)  //DOC:insert-queue
-    ;
-  *pp = b;
-
-  // Start disk if necessary.
-  if(idequeue == b)
-    idestart(b);
+  ideenqueue(b);
 
   // Wait for request to finish.
   while((b->flags & (B_VALID|B_DIRTY)) != B_VALID){
@@ -166,3 +181,20 @@ iderw(struct buf *b)
 
   release(&idelock);
 }
+
+// Start reading b, which breadahead() has locked, and return
+// without waiting.  ideintr() passes b to bdone() when it is read.
+void
+idereadasync(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("idereadasync: buf not locked");
+  if(b->flags & (B_VALID|B_DIRTY))
+    panic("idereadasync: not a read");
+  if(b->dev != 0 && !havedisk1)
+    panic("idereadasync: ide disk 1 not present");
+
+  acquire(&idelock);
+  ideenqueue(b);
+  release(&idelock);
+}
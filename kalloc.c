@@ -1,6 +1,7 @@
 // Physical memory allocator, intended to allocate
 // memory for user processes, kernel stacks, page table pages,
-// and pipe buffers. Allocates 4096-byte pages.
+// and pipe buffers. Allocates 4096-byte pages, or runs of
+// 2^order physically contiguous pages with kallocpages().
 
 #include "types.h"
 #include "defs.h"
@@ -8,21 +9,236 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "spinlock.h"
+#include "memstat.h"
 
 void freerange(void *vstart, void *vend);
+static int lazycarve(void);
 extern char end[]; // first address after kernel loaded from ELF file
                    // defined by the kernel linker script in kernel.ld
 
 struct run {
   struct run *next;
+  struct run *prev;            // only kept up on the buddy lists
 };
 
+// Free memory is held by a buddy allocator: kmem.free[k] lists the
+// free blocks of 2^k pages, each aligned to its size.  A block is
+// split in halves to serve a smaller request, and a freed block is
+// merged with its buddy (the other half of the block of twice the
+// size) whenever that is free too.
+#define MAXORDER 10            // largest block: 2^MAXORDER pages, 4Mbyte
+#define NBOOTFRAMES ((4*1024*1024)/PGSIZE)  // pages entrypgdir maps
+
+uint physend;                  // top of the RAM in use, set by kinit1()
+
+// Memory handed over by kinit1() and kinit2() is not put on the lists
+// at boot.  It stays in kmem.lazy[] as ranges no one has touched yet,
+// and buddyalloc() carves blocks off their fronts when the lists run
+// out, so boot time does not grow with the amount of RAM.
 struct {
   struct spinlock lock;
   int use_lock;
-  struct run *freelist;
+  struct run free[MAXORDER+1]; // circular lists, one per order
+  struct {
+    char *start;               // next page to carve
+    char *end;
+  } lazy[2];                   // one range from each of kinit1 and kinit2
+  int nlazy;
 } kmem;
 
+// Per-CPU caches of free pages, so that most kalloc()/kfree() calls
+// stay off kmem.lock.  A CPU refills its cache from the buddy lists
+// PCP_BATCH pages at a time when it runs dry and hands PCP_BATCH back
+// once it holds more than PCP_HIGH.  Each cache has a lock, which
+// only its own CPU takes unless pcpdrain() is pulling pages back for
+// an allocation that would otherwise fail; a cache lock is taken
+// before kmem.lock.  Used once kinit2() sets kmem.use_lock.
+#define PCP_BATCH 8
+#define PCP_HIGH  16
+
+static struct pcpcache {
+  struct spinlock lock;
+  struct run *freelist;
+  int n;
+} pcp[NCPU];
+
+// Pages that idle CPUs have already zeroed, for kalloczeroed().  They
+// count as free memory, and kalloc() falls back on them when the
+// allocator is otherwise exhausted.
+struct {
+  struct spinlock lock;
+  struct run *list;
+  int n;
+} zpool;
+
+// Counts of physical pages handed to the allocator, used to judge
+// memory pressure.
+struct {
+  int initPagesNo;             // pages put on the free list at boot
+  int currentFreePagesNo;      // pages in kmem.free[] now; pcp[] has more
+} physPagesCounts;
+
+// Reverse map: one descriptor per physical page, indexed by physical
+// page number.  For a frame mapped into user memory it records the
+// page directory and virtual address, so paging code can get from a
+// frame to its PTE without walking every process.  Cleared by kfree().
+// A frame merged by KSM is mapped refcnt times; kfree() drops one
+// reference and only frees the frame with the last.  The descriptor
+// has room for one mapping only, so it names the first of them, and
+// kfree() cannot tell which mapping a dropped reference belonged to:
+// it forgets the owner of a shared frame as soon as any reference
+// goes, rather than leave it naming a mapping that may be gone.
+//
+// There are as many descriptors as pages below physend.  Until kinit2()
+// maps the rest of RAM only the first 4Mbyte is usable, so they start
+// out in bootframes[]; kinit2() moves them to an array it takes from
+// the front of its range.
+struct frame {
+  pde_t *pgdir;                // page directory mapping the frame, or 0
+  uint va;                     // user virtual address it is mapped at
+  int refcnt;                  // references, 0 while free
+  short freeorder;             // k+1 if first page of a free 2^k block
+  short tag;                   // MT_* use of an allocated frame
+};
+static struct frame bootframes[NBOOTFRAMES];
+static struct frame *frames = bootframes;
+static uint nframes = NBOOTFRAMES;
+
+static void
+listpush(struct run *head, struct run *r)
+{
+  r->next = head->next;
+  r->prev = head;
+  head->next->prev = r;
+  head->next = r;
+}
+
+static void
+listdel(struct run *r)
+{
+  r->prev->next = r->next;
+  r->next->prev = r->prev;
+}
+
+// Take a free block of 2^order pages off the buddy lists, splitting a
+// bigger one if need be.  Caller holds kmem.lock if use_lock.
+static struct run*
+buddyalloc(int order)
+{
+  struct run *r, *half;
+  int k;
+
+  for(;;){
+    for(k = order; k <= MAXORDER; k++)
+      if(kmem.free[k].next != &kmem.free[k])
+        break;
+    if(k <= MAXORDER)
+      break;
+    if(lazycarve() < 0)
+      return 0;
+  }
+  r = kmem.free[k].next;
+  listdel(r);
+  frames[V2P(r)/PGSIZE].freeorder = 0;
+  while(k > order){
+    k--;
+    half = (struct run*)((char*)r + (PGSIZE << k));
+    frames[V2P(half)/PGSIZE].freeorder = k+1;
+    listpush(&kmem.free[k], half);
+  }
+  physPagesCounts.currentFreePagesNo -= 1 << order;
+  return r;
+}
+
+// Put the block of 2^order pages at v back, merging it with its buddy
+// for as long as the buddy is free.  Caller holds kmem.lock if use_lock.
+static void
+buddyfree(char *v, int order)
+{
+  uint pfn, bpfn;
+
+  physPagesCounts.currentFreePagesNo += 1 << order;
+  pfn = V2P(v)/PGSIZE;
+  for(; order < MAXORDER; order++){
+    bpfn = pfn ^ (1 << order);
+    if(bpfn >= nframes || frames[bpfn].freeorder != order+1)
+      break;
+    listdel((struct run*)P2V(bpfn*PGSIZE));
+    frames[bpfn].freeorder = 0;
+    pfn &= ~(1 << order);
+  }
+  frames[pfn].freeorder = order+1;
+  listpush(&kmem.free[order], (struct run*)P2V(pfn*PGSIZE));
+}
+
+// Move the largest aligned block at the front of the untouched memory
+// onto the buddy lists.  Returns -1 if nothing is left to carve.
+// Caller holds kmem.lock if use_lock.
+static int
+lazycarve(void)
+{
+  char *v;
+  int i, k;
+
+  for(i = 0; i < kmem.nlazy; i++)
+    if(kmem.lazy[i].start < kmem.lazy[i].end)
+      break;
+  if(i == kmem.nlazy)
+    return -1;
+  v = kmem.lazy[i].start;
+  for(k = MAXORDER; k > 0; k--)
+    if(V2P(v) % (PGSIZE << k) == 0 && v + (PGSIZE << k) <= kmem.lazy[i].end)
+      break;
+  kmem.lazy[i].start = v + (PGSIZE << k);
+  // Already counted as free by freerange().
+  physPagesCounts.currentFreePagesNo -= 1 << k;
+  buddyfree(v, k);
+  return 0;
+}
+
+// Bytes of RAM, from the sizes the BIOS leaves in the CMOS: 64Kbyte
+// units above 16Mbyte at 0x34/0x35, or Kbytes above 1Mbyte at
+// 0x30/0x31 on machines with less.  Capped at PHYSTOP, the most the
+// kernel can direct-map.
+static uint
+memsize(void)
+{
+  uint n;
+
+  n = cmos_read(0x34) | cmos_read(0x35) << 8;
+  if(n > 0){
+    if(n >= (PHYSTOP - 0x1000000) / 0x10000)
+      return PHYSTOP;
+    return 0x1000000 + n * 0x10000;
+  }
+  n = cmos_read(0x30) | cmos_read(0x31) << 8;
+  if(n > 0)
+    return EXTMEM + n * 1024;
+  return PHYSLOW;
+}
+
+// Check that kallocpages() hands out blocks aligned to their size
+// that do not overlap, and that kfreepages() takes them back.  Run
+// once at boot: no user program can reach these calls to test them.
+static void
+buddytest(void)
+{
+  char *v[5];
+  int j, k;
+
+  for(k = 0; k < 5; k++){
+    if((v[k] = kallocpages(k)) == 0)
+      panic("buddytest: kallocpages");
+    if(V2P(v[k]) % (PGSIZE << k))
+      panic("buddytest: misaligned");
+    for(j = 0; j < k; j++)
+      if(v[j] < v[k] + (PGSIZE << k) && v[k] < v[j] + (PGSIZE << j))
+        panic("buddytest: overlap");
+  }
+  for(k = 4; k >= 0; k--)
+    kfreepages(v[k], k);
+}
+
 // Initialization happens in two phases.
 // 1. main() calls kinit1() while still using entrypgdir to place just
 // the pages mapped by entrypgdir on free list.
@@ -31,14 +247,24 @@ struct {
 void
 kinit1(void *vstart, void *vend)
 {
+  int k;
+
   initlock(&kmem.lock, "kmem");
+  initlock(&zpool.lock, "zpool");
+  for(k = 0; k < NCPU; k++)
+    initlock(&pcp[k].lock, "pcp");
   kmem.use_lock = 0;
+  physend = PGROUNDDOWN(memsize());
+  if(physend < V2P(vend))
+    panic("kinit1: too little memory");
+  for(k = 0; k <= MAXORDER; k++)
+    kmem.free[k].next = kmem.free[k].prev = &kmem.free[k];
   freerange(vstart, vend);
 
-  // physPagesCounts is a struct defined in kalloc.h to hold info needed to cumpute percent of free physcal pages
+  // physPagesCounts holds the info needed to compute the percent of free physical pages.
   // all physical pages allocated to the kernel's allocator's "freelist" are allocated in kinit1 & kinit2
   // here we update the # of pages inserted to free list in kinit1
-  //physPagesCounts.initPagesNo = (PGROUNDDOWN((uint)vend) - PGROUNDUP((uint)vstart)) / PGSIZE;
+  physPagesCounts.initPagesNo = (PGROUNDDOWN((uint)vend) - PGROUNDUP((uint)vstart)) / PGSIZE;
   //cprintf("physPagesCounts->initPagesNo = %d\n", physPagesCounts.initPagesNo );
   //cprintf("physPagesCounts->currentFreePagesNo = %d\n", physPagesCounts.currentFreePagesNo );
 
@@ -47,25 +273,47 @@ kinit1(void *vstart, void *vend)
 void
 kinit2(void *vstart, void *vend)
 {
+  struct frame *f;
+  uint n;
+
+  // Take the page descriptors for all of RAM off the front.
+  n = V2P(vend) / PGSIZE;
+  f = (struct frame*)PGROUNDUP((uint)vstart);
+  vstart = (char*)f + PGROUNDUP(n * sizeof(struct frame));
+  memset(f, 0, n * sizeof(struct frame));
+  memmove(f, frames, nframes * sizeof(struct frame));
+  frames = f;
+  nframes = n;
+
   freerange(vstart, vend);
 
   // update the # of pages inserted to free list in kinit2
-  //physPagesCounts.initPagesNo += (PGROUNDDOWN((uint)vend) - PGROUNDUP((uint)vstart)) / PGSIZE;
+  physPagesCounts.initPagesNo += (PGROUNDDOWN((uint)vend) - PGROUNDUP((uint)vstart)) / PGSIZE;
   
   //cprintf("physPagesCounts->initPagesNo = %d\n", physPagesCounts.initPagesNo );
   //cprintf("physPagesCounts->currentFreePagesNo = %d\n", physPagesCounts.currentFreePagesNo );
   //cprintf("percent of free physical pages: %d\n", physPagesCounts.currentFreePagesNo * 100 / physPagesCounts.initPagesNo);
 
+  buddytest();
   kmem.use_lock = 1;
 }
 
+// Add the pages between vstart and vend to the untouched memory.
 void
 freerange(void *vstart, void *vend)
 {
-  char *p;
-  p = (char*)PGROUNDUP((uint)vstart);
-  for(; p + PGSIZE <= (char*)vend; p += PGSIZE)
-    kfree(p);
+  char *s, *e;
+
+  s = (char*)PGROUNDUP((uint)vstart);
+  e = (char*)PGROUNDDOWN((uint)vend);
+  if(s < end || V2P(e)/PGSIZE > nframes || kmem.nlazy == NELEM(kmem.lazy))
+    panic("freerange");
+  if(s >= e)
+    return;
+  kmem.lazy[kmem.nlazy].start = s;
+  kmem.lazy[kmem.nlazy].end = e;
+  kmem.nlazy++;
+  physPagesCounts.currentFreePagesNo += (e - s) / PGSIZE;
 }
 //PAGEBREAK: 21
 // Free the page of physical memory pointed at by v,
@@ -76,21 +324,140 @@ void
 kfree(char *v)
 {
   struct run *r;
+  struct frame *f;
+  struct pcpcache *c;
+  int i;
 
-  if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
+  if((uint)v % PGSIZE || v < end || V2P(v)/PGSIZE >= nframes)
     panic("kfree");
 
+  // Only a KSM-shared frame has more than one reference, and an
+  // unshared one cannot become shared while it is being freed.
+  f = &frames[V2P(v)/PGSIZE];
+  if(f->refcnt > 1){
+    acquire(&kmem.lock);
+    if(f->refcnt > 1){
+      f->refcnt--;
+      f->pgdir = 0;
+      release(&kmem.lock);
+      return;
+    }
+    release(&kmem.lock);
+  }
+  f->refcnt = 0;
+  f->pgdir = 0;
+  f->tag = MT_OTHER;
+
+#ifdef KDEBUG
   // Fill with junk to catch dangling refs.
   memset(v, 1, PGSIZE);
+#endif
 
-  if(kmem.use_lock)
-    acquire(&kmem.lock);
   r = (struct run*)v;
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  //physPagesCounts.currentFreePagesNo++;
-  if(kmem.use_lock)
+  if(!kmem.use_lock){
+    buddyfree(v, 0);
+    return;
+  }
+
+  pushcli();
+  c = &pcp[cpuid()];
+  acquire(&c->lock);
+  r->next = c->freelist;
+  c->freelist = r;
+  if(++c->n > PCP_HIGH){
+    // Give a batch back to the buddy lists.
+    acquire(&kmem.lock);
+    for(i = 0; i < PCP_BATCH; i++){
+      r = c->freelist;
+      c->freelist = r->next;
+      buddyfree((char*)r, 0);
+    }
+    c->n -= PCP_BATCH;
+    release(&kmem.lock);
+  }
+  release(&c->lock);
+  popcli();
+}
+
+// Give the pages in every CPU's cache back to the buddy lists, where
+// any CPU can allocate them and they can merge into bigger blocks.
+// Called before an allocation reports failure.  Returns the number of
+// pages given back.
+static int
+pcpdrain(void)
+{
+  struct pcpcache *c;
+  struct run *r;
+  int n;
+
+  n = 0;
+  for(c = pcp; c < &pcp[NCPU]; c++){
+    if(c->n == 0)
+      continue;
+    acquire(&c->lock);
+    acquire(&kmem.lock);
+    while((r = c->freelist) != 0){
+      c->freelist = r->next;
+      buddyfree((char*)r, 0);
+      n++;
+    }
+    c->n = 0;
     release(&kmem.lock);
+    release(&c->lock);
+  }
+  return n;
+}
+
+// Take a page from this CPU's cache, refilling it from the buddy
+// lists if it is empty.  Returns 0 if both are.
+static struct run*
+pcpalloc(void)
+{
+  struct run *r;
+  struct pcpcache *c;
+
+  pushcli();
+  c = &pcp[cpuid()];
+  acquire(&c->lock);
+  if(c->freelist == 0){
+    // Take a batch from the buddy lists.
+    acquire(&kmem.lock);
+    while(c->n < PCP_BATCH && (r = buddyalloc(0)) != 0){
+      r->next = c->freelist;
+      c->freelist = r;
+      c->n++;
+    }
+    release(&kmem.lock);
+  }
+  r = c->freelist;
+  if(r){
+    c->freelist = r->next;
+    c->n--;
+  }
+  release(&c->lock);
+  popcli();
+  return r;
+}
+
+// Take a page off the zero pool, or return 0 if it is empty.
+static char*
+zpooltake(void)
+{
+  struct run *r;
+
+  if(zpool.n == 0)
+    return 0;
+  acquire(&zpool.lock);
+  if((r = zpool.list) != 0){
+    zpool.list = r->next;
+    zpool.n--;
+  }
+  release(&zpool.lock);
+  if(r == 0)
+    return 0;
+  r->next = 0;                 // the only word the pool wrote
+  frames[V2P(r)/PGSIZE].tag = MT_OTHER;
+  return (char*)r;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -100,16 +467,218 @@ char*
 kalloc(void)
 {
   struct run *r;
+  char *v;
+
+  if(!kmem.use_lock){
+    if((r = buddyalloc(0)) != 0){
+      frames[V2P(r)/PGSIZE].refcnt = 1;
+      frames[V2P(r)/PGSIZE].tag = MT_OTHER;
+    }
+    return (char*)r;
+  }
+
+  if((r = pcpalloc()) == 0){
+    if((v = zpooltake()) != 0)
+      return v;
+    // Other CPUs may be sitting on free pages.
+    if(pcpdrain() == 0 || (r = pcpalloc()) == 0)
+      return 0;
+  }
+  frames[V2P(r)/PGSIZE].refcnt = 1;
+  frames[V2P(r)/PGSIZE].tag = MT_OTHER;
+  return (char*)r;
+}
+
+// Allocate a zero-filled page, from the pool if it has one.
+char*
+kalloczeroed(void)
+{
+  char *v;
 
+  if((v = zpooltake()) != 0)
+    return v;
+  if((v = kalloc()) != 0)
+    memset(v, 0, PGSIZE);
+  return v;
+}
+
+// Zero one page into the pool if it is short and memory is not low.
+// Called by the scheduler when it finds nothing to run, so the
+// zeroing happens on idle time instead of in page faults and fork.
+void
+zeropoolfill(void)
+{
+  struct run *r;
+
+  if(!kmem.use_lock || zpool.n >= ZEROPOOL || kfreepercent() < LOWMEM_PCT)
+    return;
+  if((r = (struct run*)kalloc()) == 0)
+    return;
+  memset(r, 0, PGSIZE);
+  frametag((char*)r, MT_ZERO);
+  acquire(&zpool.lock);
+  r->next = zpool.list;
+  zpool.list = r;
+  zpool.n++;
+  release(&zpool.lock);
+}
+
+// Allocate 2^order physically contiguous pages, aligned to their
+// size, for the kernel.  Returns 0 if there is no such run free.
+// Free with kfreepages() and the same order, or page by page with
+// kfree().
+char*
+kallocpages(int order)
+{
+  struct run *r;
+  int i;
+
+  if(order < 0 || order > MAXORDER)
+    return 0;
   if(kmem.use_lock)
     acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r){
-    kmem.freelist = r->next;
-    //physPagesCounts.currentFreePagesNo--;
-  }
+  r = buddyalloc(order);
   if(kmem.use_lock)
     release(&kmem.lock);
+  // The pages the CPUs cache may complete a free block.
+  if(r == 0 && kmem.use_lock && pcpdrain() > 0){
+    acquire(&kmem.lock);
+    r = buddyalloc(order);
+    release(&kmem.lock);
+  }
+  if(r)
+    for(i = 0; i < (1 << order); i++){
+      frames[V2P(r)/PGSIZE + i].refcnt = 1;
+      frames[V2P(r)/PGSIZE + i].tag = MT_OTHER;
+    }
   return (char*)r;
 }
 
+// Free 2^order pages from kallocpages().
+void
+kfreepages(char *v, int order)
+{
+  int i;
+
+  if(order < 0 || order > MAXORDER || (uint)v % (PGSIZE << order) ||
+     v < end || V2P(v)/PGSIZE + (1 << order) > nframes)
+    panic("kfreepages");
+  for(i = 0; i < (1 << order); i++){
+    frames[V2P(v)/PGSIZE + i].refcnt = 0;
+    frames[V2P(v)/PGSIZE + i].pgdir = 0;
+  }
+#ifdef KDEBUG
+  memset(v, 1, PGSIZE << order);
+#endif
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  buddyfree(v, order);
+  if(kmem.use_lock)
+    release(&kmem.lock);
+}
+
+// Percentage of the boot-time physical pages that are free.
+int
+kfreepercent(void)
+{
+  int i, n;
+
+  if(physPagesCounts.initPagesNo == 0)
+    return 100;
+  n = physPagesCounts.currentFreePagesNo + zpool.n;
+  for(i = 0; i < NCPU; i++)
+    n += pcp[i].n;
+  return n * 100 / physPagesCounts.initPagesNo;
+}
+
+// Record that the frame at physical address pa is mapped at user
+// address va in pgdir.
+void
+frameset(uint pa, pde_t *pgdir, uint va)
+{
+  if(pa % PGSIZE || pa/PGSIZE >= nframes)
+    panic("frameset");
+  frames[pa/PGSIZE].pgdir = pgdir;
+  frames[pa/PGSIZE].va = va;
+  frames[pa/PGSIZE].tag = MT_USER;
+}
+
+// Record what the allocated page at v is used for (MT_* in
+// memstat.h).  kalloc() tags pages MT_OTHER, and frameset() tags
+// user memory.
+void
+frametag(char *v, int tag)
+{
+  if((uint)v % PGSIZE || v < end || V2P(v)/PGSIZE >= nframes)
+    panic("frametag");
+  frames[V2P(v)/PGSIZE].tag = tag;
+}
+
+// Fill in *st from the frame descriptors.  The counts are not taken
+// atomically, so they may be a little off while memory is changing
+// hands.
+void
+kmemstat(struct memstat *st)
+{
+  struct frame *f;
+  int i;
+
+  memset(st, 0, sizeof(*st));
+  st->total = physPagesCounts.initPagesNo;
+  st->free = physPagesCounts.currentFreePagesNo + zpool.n;
+  for(i = 0; i < NCPU; i++)
+    st->free += pcp[i].n;
+  st->used = st->total - st->free;
+  st->zeroed = zpool.n;
+  for(f = frames; f < &frames[nframes]; f++){
+    if(f->refcnt == 0)
+      continue;
+    switch(f->tag){
+    case MT_USER:   st->user++;   break;
+    case MT_PGTAB:  st->pgtab++;  break;
+    case MT_KSTACK: st->kstack++; break;
+    case MT_PIPE:   st->pipe++;   break;
+    case MT_BCACHE: st->bcache++; break;
+    case MT_SLAB:   st->slab++;   break;
+    case MT_ZERO:                 break;
+    default:        st->other++;  break;
+    }
+  }
+}
+
+// The page directory that maps the frame at pa into user memory, or
+// 0 if none does; *va gets the address it is mapped at.  A frame KSM
+// shares names only its first mapping, and none once any of its
+// references has been dropped.
+pde_t*
+frameowner(uint pa, uint *va)
+{
+  struct frame *f;
+
+  if(pa % PGSIZE || pa/PGSIZE >= nframes)
+    panic("frameowner");
+  f = &frames[pa/PGSIZE];
+  if(f->pgdir && va)
+    *va = f->va;
+  return f->pgdir;
+}
+
+// Take another reference to the frame at pa.
+void
+frameref(uint pa)
+{
+  if(pa % PGSIZE || pa/PGSIZE >= nframes)
+    panic("frameref");
+  acquire(&kmem.lock);
+  frames[pa/PGSIZE].refcnt++;
+  release(&kmem.lock);
+}
+
+// Number of references to the frame at pa.
+int
+framerefs(uint pa)
+{
+  if(pa % PGSIZE || pa/PGSIZE >= nframes)
+    panic("framerefs");
+  return frames[pa/PGSIZE].refcnt;
+}
@@ -1,7 +1,9 @@
 // Memory layout
 
 #define EXTMEM  0x100000            // Start of extended memory
-#define PHYSTOP 0xE000000           // Top physical memory
+#define PHYSTOP 0x7E000000          // Top of the direct map: most RAM used
+#define PHYSLOW 0xE000000           // RAM when the CMOS gives no size, and
+                                    // most used without 4Mbyte pages
 #define DEVSPACE 0xFE000000         // Other devices are at high addresses
 
 // Key addresses for address space layout (see kmap in vm.c for layout)
@@ -0,0 +1,29 @@
+// Memory pressure levels reported by mempressure().
+#define MEM_OK        0  // plenty of free frames and swap
+#define MEM_LOW       1  // caches should be trimmed
+#define MEM_CRITICAL  2  // the kernel is about to page
+
+// Physical memory use reported by memstat(), in frames.
+struct memstat {
+  uint total;        // frames handed to the allocator at boot
+  uint free;         // frames free, zeroed ones included
+  uint used;         // total - free
+  uint user;         // user memory
+  uint pgtab;        // page directories and page tables
+  uint kstack;       // kernel stacks
+  uint pipe;         // pipe buffers
+  uint bcache;       // buffer cache
+  uint slab;         // other slab caches: files, inodes, paging arrays
+  uint other;        // the rest of the kernel's allocations
+  uint zeroed;       // free frames already zeroed by idle CPUs
+};
+
+// What a frame in use holds (see frametag()).
+#define MT_OTHER   0
+#define MT_USER    1
+#define MT_PGTAB   2
+#define MT_KSTACK  3
+#define MT_PIPE    4
+#define MT_BCACHE  5
+#define MT_SLAB    6
+#define MT_ZERO    7
@@ -0,0 +1,7 @@
+// Advice for madvise().
+#define MADV_NORMAL     0  // no special treatment
+#define MADV_RANDOM     1  // no readahead
+#define MADV_SEQUENTIAL 2  // read ahead, evict pages already passed
+#define MADV_WILLNEED   3  // read swapped-out pages in now
+#define MADV_DONTNEED   4  // contents not needed; zero on next touch
+#define MADV_FREE       8  // same as MADV_DONTNEED
@@ -10,6 +10,14 @@
 #define CR0_PG          0x80000000      // Paging
 
 #define CR4_PSE         0x00000010      // Page size extension
+#define CR4_PGE         0x00000080      // Page global enable
+
+// CPUID leaf 1 %edx feature flags
+#define CPUID_PSE       0x00000008      // 4Mbyte pages
+#define CPUID_PGE       0x00002000      // Global pages
+
+// Page fault error code bits
+#define FEC_WR          0x002   // Fault was caused by a write
 
 // various segment selectors.
 #define SEG_KCODE 1  // kernel code
@@ -83,6 +91,7 @@ struct segdesc {
 #define NPDENTRIES      1024    // # directory entries per page directory
 #define NPTENTRIES      1024    // # PTEs per page table
 #define PGSIZE          4096    // bytes mapped by a page
+#define PDSIZE          (PGSIZE*NPTENTRIES) // bytes mapped by a 4Mbyte page
 
 #define PTXSHIFT        12      // offset of PTX in a linear address
 #define PDXSHIFT        22      // offset of PDX in a linear address
@@ -95,8 +104,11 @@ struct segdesc {
 #define PTE_W           0x002   // Writeable
 #define PTE_U           0x004   // User
 #define PTE_PS          0x080   // Page Size
+#define PTE_G           0x100   // Global, kept across %cr3 loads
 #define PTE_A           0x020   // Accessed
 #define PTE_PG          0x200   // Paged out to secondary storage
+#define PTE_PIN         0x400   // Pinned in memory by mlock()
+#define PTE_COW         0x800   // Shared read-only, copy on write
 
 // Address in page table or page directory entry
 #define PTE_ADDR(pte)   ((uint)(pte) & ~0xFFF)
@@ -2,13 +2,28 @@
 #define KSTACKSIZE 4096  // size of per-process kernel stack
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define NBUF         (MAXOPBLOCKS*3)  // minimum size of disk block cache
 #define FSSIZE       1000  // size of file system in blocks
 
+#define LC_WINDOW    10  // ticks per load control sampling window
+#define LC_HIGHWATER 50  // swap-in faults per window that mean thrashing
+#define LC_LOWWATER  10  // fault rate below which suspended procs resume
+#define SWAPIDLE    500  // ticks asleep before a process is swapped out whole
+#define OOMWAIT      10  // ticks an allocation waits on an OOM victim
+#define LOWMEM_PCT   10  // free frames (% of RAM) under which memory is low
+#define CRITMEM_PCT   3  // free frames (% of RAM) under which it is critical
+#define LOWSWAP_PCT  75  // swap slots in use (%) over which memory is low
+#define CRITSWAP_PCT 90  // swap slots in use (%) over which it is critical
+#define MADV_READAHEAD 2 // pages read ahead of a MADV_SEQUENTIAL fault
+#define KSM_INTERVAL 100 // ticks between same-page merging passes
+#define KSM_BATCH    64  // pages hashed per merging pass
+#define ZEROPOOL     32  // pre-zeroed pages idle CPUs keep ready
+#define BCACHE_PCT    2  // most RAM (%) the buffer cache grows to
+#define BSHRINK      64  // buffers kswapd frees per pass when memory is low
+#define ISHRINK      32  // inodes kswapd frees per pass when memory is low
+#define READAHEAD     8  // blocks read ahead of a sequential file read
@@ -6,6 +6,10 @@
 #include "x86.h"
 #include "proc.h"
 #include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "memstat.h"
 
 #define DEBUG 0
 #define TRUE 0
@@ -16,6 +20,7 @@ struct {
 } ptable;
 
 static struct proc *initproc;
+static struct proc *kswapdproc;
 
 int nextpid = 1;
 extern void forkret(void);
@@ -23,13 +28,78 @@ extern void trapret(void);
 
 static void wakeup1(void *chan);
 
+// Load control.  Swap-in faults are counted system-wide; when a
+// sampling window sees more than the swap device can keep up with,
+// scheduler() suspends the youngest process so the rest can make
+// progress, and lets suspended processes back in, oldest first,
+// once the rate has dropped.
+struct {
+  struct spinlock lock;
+  uint faults;                 // swap-in faults in the current window
+  uint start;                  // ticks when the current window began
+} loadctl;
+
 
 
+// Slab caches for the per-process paging arrays.
+static struct slabcache *freedcache;
+static struct slabcache *swappedcache;
 
 void
 pinit(void)
 {
   initlock(&ptable.lock, "ptable");
+  initlock(&loadctl.lock, "loadctl");
+  freedcache = slabcreate("pagesFreed", MAX_PSYC_PAGES*sizeof(struct emptyPages), MT_SLAB);
+  swappedcache = slabcreate("pagesSwapped", MAX_PSYC_PAGES*sizeof(struct swpdPages), MT_SLAB);
+}
+
+// Give p fresh, empty paging arrays.  The old ones, if any, are left
+// to the caller.  Returns -1 if out of memory.
+int
+allocPageMeta(struct proc *p)
+{
+  struct emptyPages *freed;
+  struct swpdPages *swapped;
+  int i;
+
+  if((freed = slaballoc(freedcache)) == 0)
+    return -1;
+  if((swapped = slaballoc(swappedcache)) == 0){
+    slabfree(freedcache, freed);
+    return -1;
+  }
+  for (i = 0; i < MAX_PSYC_PAGES; i++) {
+    freed[i].virtualAddress = (char*)0xffffffff;
+    freed[i].next = 0;
+    freed[i].prev = 0;
+    swapped[i].swaploc = 0;
+    swapped[i].virtualAddress = (char*)0xffffffff;
+  }
+  p->pagesFreedARR = freed;
+  p->pagesSwappedARR = swapped;
+  return 0;
+}
+
+void
+freePageMeta(struct emptyPages *freed, struct swpdPages *swapped)
+{
+  if(freed)
+    slabfree(freedcache, freed);
+  if(swapped)
+    slabfree(swappedcache, swapped);
+}
+
+// Release a process slot whose kernel stack and paging arrays were
+// allocated by allocproc().
+static void
+freeprocmem(struct proc *p)
+{
+  kfree(p->kstack);
+  p->kstack = 0;
+  freePageMeta(p->pagesFreedARR, p->pagesSwappedARR);
+  p->pagesFreedARR = 0;
+  p->pagesSwappedARR = 0;
 }
 
 // Must be called with interrupts disabled
@@ -102,6 +172,13 @@ found:
     p->state = UNUSED;
     return 0;
   }
+  frametag(p->kstack, MT_KSTACK);
+  if(allocPageMeta(p) < 0){
+    kfree(p->kstack);
+    p->kstack = 0;
+    p->state = UNUSED;
+    return 0;
+  }
   sp = p->kstack + KSTACKSIZE;
 
   // Leave room for trap frame.
@@ -120,17 +197,17 @@ found:
 
 
   // initialize process's page data
-  for (int i = 0; i < MAX_PSYC_PAGES; i++) {
-    p->pagesFreedARR[i].virtualAddress = (char*)0xffffffff;
-    p->pagesFreedARR[i].next = 0;
-    p->pagesFreedARR[i].prev = 0;
-    p->pagesSwappedARR[i].swaploc = 0;
-    p->pagesSwappedARR[i].virtualAddress = (char*)0xffffffff;
-  }
   p->pagesInPhyMem = 0;
   p->pagesInSwapFile = 0;
   p->head = 0;
   p->tail = 0;
+  p->pagesPinned = 0;
+  p->suspended = 0;
+  p->swappedout = 0;
+  p->pagingio = 0;
+  for (int i = 0; i < MAX_SWAP_PGTABS; i++)
+    p->pgtabSwapped[i] = -1;
+  memset(p->madv, 0, sizeof(p->madv));
 
   return p;
 }
@@ -171,6 +248,8 @@ userinit(void)
   p->state = RUNNABLE;
 
   release(&ptable.lock);
+
+  kswapdinit();
 }
 
 // Grow current process's memory by n bytes.
@@ -211,11 +290,37 @@ fork(void)
 
   // Copy process state from proc.
   if((np->pgdir = copyuvm(curproc->pgdir, curproc->sz)) == 0){
-    kfree(np->kstack);
-    np->kstack = 0;
+    freeprocmem(np);
     np->state = UNUSED;
     return -1;
   }
+
+  if(createSwapFile(np) < 0){
+    freevm(np->pgdir);
+    np->pgdir = 0;
+    freeprocmem(np);
+    np->state = UNUSED;
+    return -1;
+  }
+  char buf[PGSIZE / 2] = "";
+  int offset = 0;
+  int nread = 0;
+  // read the parent's swap file in chunks of size PGDIR/2, otherwise for some
+  // reason, you get "panic acquire" if buf is ~4000 bytes
+  while (curproc->swapFile &&
+         (nread = readFromSwapFile(curproc, buf, offset, PGSIZE / 2)) > 0) {
+    if (writeToSwapFile(np, buf, offset, nread) != nread) {
+      // Out of disk for the child's copy; back out.
+      removeSwapFile(np);
+      freevm(np->pgdir);
+      np->pgdir = 0;
+      freeprocmem(np);
+      np->state = UNUSED;
+      return -1;
+    }
+    offset += nread;
+  }
+
   if(DEBUG) 
     cprintf("fork:copyuvm proc->pagesinmem:%d\n", curproc->pagesInPhyMem);
   np->pagesInPhyMem = curproc->pagesInPhyMem;
@@ -243,19 +348,6 @@ fork(void)
   //   np->pages[i].swaploc = proc->pages[i].swaploc;
   // }
   // np->pagesinmem = 0;
-  createSwapFile(np);
-  char buf[PGSIZE / 2] = "";
-  int offset = 0;
-  int nread = 0;
-  // read the parent's swap file in chunks of size PGDIR/2, otherwise for some
-  // reason, you get "panic acquire" if buf is ~4000 bytes
-  if (strncmp(curproc->name, "init",4) != 0 && strncmp(curproc->name, "sh", 2) != 0) {
-    while ((nread = readFromSwapFile(curproc, buf, offset, PGSIZE / 2)) != 0) {
-      if (writeToSwapFile(np, buf, offset, nread) == -1)
-        panic("fork: error while writing the parent's swap file to the child");
-      offset += nread;
-    }
-  }
 
   // no need for this after all
 
@@ -276,25 +368,20 @@ fork(void)
     np->pagesSwappedARR[i].virtualAddress = curproc->pagesSwappedARR[i].virtualAddress;
     np->pagesSwappedARR[i].swaploc = curproc->pagesSwappedARR[i].swaploc;
   }
+  memmove(np->madv, curproc->madv, sizeof(np->madv));
 
-  for (int i = 0; i < MAX_PSYC_PAGES; i++) 
-    for (int j = 0; j < MAX_PSYC_PAGES; ++j){
-      if(np->pagesFreedARR[j].virtualAddress == curproc->pagesFreedARR[i].next->virtualAddress)
-        np->pagesFreedARR[i].next = &np->pagesFreedARR[j];
-      if(np->pagesFreedARR[j].virtualAddress == curproc->pagesFreedARR[i].prev->virtualAddress)
-        np->pagesFreedARR[i].prev = &np->pagesFreedARR[j];
-    }
-
-      
+  // The list links point into the parent's array; rebase them onto
+  // the child's.  Unused links are 0 and must stay 0.
+#define REBASE(l) ((l) ? &np->pagesFreedARR[(l) - curproc->pagesFreedARR] : 0)
   for (int i = 0; i < MAX_PSYC_PAGES; i++) {
-    if (curproc->head->virtualAddress == np->pagesFreedARR[i].virtualAddress){
-      if(DEBUG) 
-        cprintf("\nfork: head copied!\n\n");
-      np->head = &np->pagesFreedARR[i];
-    }
-    if (curproc->tail->virtualAddress == np->pagesFreedARR[i].virtualAddress)
-      np->tail = &np->pagesFreedARR[i];
+    np->pagesFreedARR[i].next = REBASE(curproc->pagesFreedARR[i].next);
+    np->pagesFreedARR[i].prev = REBASE(curproc->pagesFreedARR[i].prev);
   }
+  np->head = REBASE(curproc->head);
+  np->tail = REBASE(curproc->tail);
+#undef REBASE
+  if(DEBUG && np->head)
+    cprintf("\nfork: head copied!\n\n");
 
   acquire(&ptable.lock);
 
@@ -331,6 +418,14 @@ printProcMemPageInfo(struct proc *proc){
   //print out memory pages info:
   cprintf("No. of pages currently in physical memory: %d,\n", proc->pagesInPhyMem);
   cprintf("No. of pages currently paged out: %d,\n", proc->pagesInSwapFile);
+  if(proc->pgdir)
+    cprintf("No. of page-table pages: %d,\n", countpgtabs(proc->pgdir));
+  if(proc->pagesPinned)
+    cprintf("No. of pages pinned by mlock: %d,\n", proc->pagesPinned);
+  if(proc->suspended)
+    cprintf("Suspended by load control,\n");
+  if(proc->swappedout)
+    cprintf("Swapped out while idle,\n");
 
   // regular xv6 procdump printing
   if(proc->state == SLEEPING){
@@ -384,8 +479,15 @@ exit(void)
     }
   }
 
-  if (removeSwapFile(curproc) != 0)
-    panic("exit: error deleting swap file");
+  // No swap file if exec() could not make one.  One that cannot be
+  // deleted (no memory for its inode) is left behind, and reused by
+  // the next process with this pid.
+  if (curproc->swapFile && removeSwapFile(curproc) != 0)
+    cprintf("exit: pid %d: could not delete swap file\n", curproc->pid);
+
+  // Give the user pages back now instead of when the parent reaps
+  // us, so that an OOM victim frees its memory promptly.
+  deallocuvm(curproc->pgdir, curproc->sz, 0);
 
   if (TRUE){
   // sending proc as arg just to share func with procdump
@@ -438,8 +540,7 @@ wait(void)
       if(p->state == ZOMBIE){
         // Found one.
         pid = p->pid;
-        kfree(p->kstack);
-        p->kstack = 0;
+        freeprocmem(p);
         // TODO delete 
         cprintf("freevm(p->pgdir)\n");
         freevm(p->pgdir);
@@ -464,6 +565,161 @@ wait(void)
   }
 }
 
+// Current memory pressure level, from the share of free frames and
+// the share of swap file slots in use.  Caller must hold ptable.lock.
+static int
+mempressure(void)
+{
+  struct proc *p;
+  int used, total, freepct, swappct;
+
+  used = total = 0;
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+    if(p->state == UNUSED || p->swapFile == 0)
+      continue;
+    used += p->pagesInSwapFile;
+    total += MAX_PSYC_PAGES;
+  }
+  swappct = total ? used * 100 / total : 0;
+  freepct = kfreepercent();
+  if(freepct < CRITMEM_PCT || swappct > CRITSWAP_PCT)
+    return MEM_CRITICAL;
+  if(freepct < LOWMEM_PCT || swappct > LOWSWAP_PCT)
+    return MEM_LOW;
+  return MEM_OK;
+}
+
+// Sleep until memory pressure is at least level.  loadcontrol()
+// re-checks for waiters every LC_WINDOW ticks.  Returns the level
+// seen, or -1 if level is not one of MEM_OK..MEM_CRITICAL or the
+// process is killed meanwhile.
+int
+mempressurewait(int level)
+{
+  int cur;
+
+  if(level < MEM_OK || level > MEM_CRITICAL)
+    return -1;
+  acquire(&ptable.lock);
+  while((cur = mempressure()) < level){
+    if(myproc()->killed){
+      release(&ptable.lock);
+      return -1;
+    }
+    sleep(&mempressure, &ptable.lock);
+  }
+  release(&ptable.lock);
+  return cur;
+}
+
+// Count one swap-in page fault towards the load control window.
+void
+loadctlfault(void)
+{
+  acquire(&loadctl.lock);
+  loadctl.faults++;
+  release(&loadctl.lock);
+}
+
+// Once per LC_WINDOW ticks, compare the swap-in fault rate against
+// the water marks and suspend or resume one process.  Only runnable
+// processes with a swap file take part, and at least one of them is
+// always left running.  Caller must hold ptable.lock.
+static void
+loadcontrol(void)
+{
+  struct proc *p, *victim;
+  uint faults;
+  int active;
+
+  if(ticks - loadctl.start < LC_WINDOW)
+    return;
+  acquire(&loadctl.lock);
+  faults = loadctl.faults;
+  loadctl.faults = 0;
+  loadctl.start = ticks;
+  release(&loadctl.lock);
+
+  victim = 0;
+  wakeup1(&kswapdproc);
+  if(mempressure() != MEM_OK)
+    wakeup1(&mempressure);
+
+  if(faults > LC_HIGHWATER){
+    active = 0;
+    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+      // Sleepers are not adding to the fault rate.
+      if(p->state != RUNNABLE && p->state != RUNNING)
+        continue;
+      if(p == initproc || p->swapFile == 0 || p->suspended || p->killed)
+        continue;
+      active++;
+      if(victim == 0 || p->pid > victim->pid)
+        victim = p;
+    }
+    if(active > 1)
+      victim->suspended = 1;
+  } else if(faults < LC_LOWWATER){
+    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
+      if(p->suspended && (victim == 0 || p->pid < victim->pid))
+        victim = p;
+    if(victim){
+      victim->suspended = 0;
+      wakeup1(&victim->suspended);
+    }
+  }
+}
+
+// OOM badness: how many pages killing p would give back, in memory,
+// in swap or as page tables.
+static int
+badness(struct proc *p)
+{
+  return p->pagesInPhyMem + p->pagesInSwapFile + countpgtabs(p->pgdir);
+}
+
+// Out of memory.  Kill the process with the highest badness score
+// unless an earlier victim is still on its way out.  init and
+// kswapd are never chosen.  A victim still swapped out is not on its
+// way out: kswapd cannot bring it back in while memory is short, so
+// it is passed over.  Returns -1 if there is nobody to kill.
+int
+oomkill(void)
+{
+  struct proc *p, *victim;
+
+  acquire(&ptable.lock);
+  victim = 0;
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+    if(p->state == UNUSED || p->state == EMBRYO || p->state == ZOMBIE)
+      continue;
+    if(p->killed){
+      if(p->swappedout)
+        continue;
+      release(&ptable.lock);
+      return 0;
+    }
+    if(p == initproc || p == kswapdproc)
+      continue;
+    if(victim == 0 || badness(p) > badness(victim))
+      victim = p;
+  }
+  if(victim == 0){
+    release(&ptable.lock);
+    return -1;
+  }
+  cprintf("oom: killing pid %d (%s), badness %d\n",
+          victim->pid, victim->name, badness(victim));
+  victim->killed = 1;
+  victim->suspended = 0;
+  if(victim->state == SLEEPING)
+    victim->state = RUNNABLE;
+  if(victim->swappedout)
+    wakeup1(&kswapdproc);
+  release(&ptable.lock);
+  return 0;
+}
+
 //PAGEBREAK: 42
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
@@ -477,6 +733,7 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int ran;
   c->proc = 0;
   
   for(;;){
@@ -485,19 +742,21 @@ scheduler(void)
 
     // Loop over process table looking for process to run.
     acquire(&ptable.lock);
+    loadcontrol();
+    ran = 0;
     for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-      if(p->state != RUNNABLE)
+      if(p->state != RUNNABLE || p->swappedout)
         continue;
+      ran = 1;
 
       // Switch to chosen process.  It is the process's job
       // to release ptable.lock and then reacquire it
       // before jumping back to us.
       c->proc = p;
-      switchuvm(p);
+      resumeuvm(p);
       p->state = RUNNING;
 
       swtch(&(c->scheduler), p->context);
-      switchkvm();
 
       // Process is done running for now.
       // It should have changed its p->state before coming back.
@@ -505,6 +764,9 @@ scheduler(void)
     }
     release(&ptable.lock);
 
+    // Nothing to run: spend the time zeroing pages.
+    if(!ran)
+      zeropoolfill();
   }
 }
 
@@ -591,6 +853,7 @@ sleep(void *chan, struct spinlock *lk)
   // Go to sleep.
   p->chan = chan;
   p->state = SLEEPING;
+  p->sleepticks = ticks;
 
   sched();
 
@@ -604,6 +867,110 @@ sleep(void *chan, struct spinlock *lk)
   }
 }
 
+// Called by a process that load control has suspended, on its way
+// back to user space.  Give up its frames and sleep until
+// loadcontrol() clears p->suspended; the pages fault back in on demand.
+void
+suspend(void)
+{
+  struct proc *p = myproc();
+
+  swapOutAll();
+  acquire(&ptable.lock);
+  while(p->suspended && !p->killed)
+    sleep(&p->suspended, &ptable.lock);
+  release(&ptable.lock);
+}
+
+// Whole-process swapping.  kswapd is a kernel-only process that
+// wakes every LC_WINDOW ticks and whenever a swapped-out process is
+// woken.  Processes asleep for SWAPIDLE ticks lose their pages and
+// page tables; a process that has been made RUNNABLE again is
+// brought back before the scheduler may pick it.  p->swappedout is
+// set before ptable.lock is dropped for the I/O, so the scheduler
+// keeps away from a process while kswapd works on it.
+// Every KSM_INTERVAL ticks kswapd also runs a same-page merging pass.
+
+// Hash up to KSM_BATCH pages for ksmScan(), starting where the last
+// pass stopped.  Caller must hold ptable.lock.
+static void
+ksmpass(void)
+{
+  static int next;
+  int i, budget;
+
+  budget = KSM_BATCH;
+  for(i = 0; i < NPROC && budget > 0; i++)
+    budget -= ksmScan(&ptable.proc[(next + i) % NPROC], budget);
+  next = (next + i) % NPROC;
+}
+
+static void
+kswapd(void)
+{
+  struct proc *p;
+  int again, ok, level;
+  uint ksmticks = 0;
+
+  // Still holding ptable.lock from scheduler.
+  for(;;){
+    again = 0;
+    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+      if(p->swappedout && p->state != SLEEPING){
+        release(&ptable.lock);
+        ok = swapInProc(p) == 0;
+        acquire(&ptable.lock);
+        if(ok)
+          p->swappedout = 0;
+      } else if(p->state == SLEEPING && !p->swappedout && p->swapFile &&
+                ticks - p->sleepticks >= SWAPIDLE){
+        // Asleep in the middle of its own swap I/O; try again later.
+        if(p->pagingio)
+          continue;
+        p->swappedout = 1;
+        release(&ptable.lock);
+        swapOutProc(p);
+        acquire(&ptable.lock);
+        // Woken while going out; bring it straight back.
+        if(p->state != SLEEPING)
+          again = 1;
+      }
+    }
+    // Give buffer and inode cache memory back while memory is short.
+    if((level = mempressure()) != MEM_OK){
+      release(&ptable.lock);
+      bshrink(level == MEM_CRITICAL ? FSSIZE : BSHRINK);
+      ishrink(level == MEM_CRITICAL ? FSSIZE : ISHRINK);
+      acquire(&ptable.lock);
+    }
+    if(ticks - ksmticks >= KSM_INTERVAL){
+      ksmticks = ticks;
+      ksmpass();
+    }
+    if(!again)
+      sleep(&kswapdproc, &ptable.lock);
+  }
+}
+
+// Start kswapd.  Called once from userinit().
+void
+kswapdinit(void)
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    panic("kswapdinit: no proc");
+  if((p->pgdir = setupkvm()) == 0)
+    panic("kswapdinit: out of memory?");
+  p->context->eip = (uint)kswapd;
+  safestrcpy(p->name, "kswapd", sizeof(p->name));
+  kswapdproc = p;
+
+  acquire(&ptable.lock);
+  p->state = RUNNABLE;
+  release(&ptable.lock);
+}
+
 //PAGEBREAK!
 // Wake up all processes sleeping on chan.
 // The ptable lock must be held.
@@ -611,10 +978,16 @@ static void
 wakeup1(void *chan)
 {
   struct proc *p;
+  int swapin = 0;
 
   for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
-    if(p->state == SLEEPING && p->chan == chan)
+    if(p->state == SLEEPING && p->chan == chan){
       p->state = RUNNABLE;
+      swapin |= p->swappedout;
+    }
+  // Swapped-out processes cannot run until kswapd brings them back.
+  if(swapin)
+    wakeup1(&kswapdproc);
 }
 
 // Wake up all processes sleeping on chan.
@@ -641,6 +1014,8 @@ kill(int pid)
       // Wake process from sleep if necessary.
       if(p->state == SLEEPING)
         p->state = RUNNABLE;
+      if(p->swappedout)
+        wakeup1(&kswapdproc);
       release(&ptable.lock);
       return 0;
     }
@@ -666,6 +1041,7 @@ procdump(void)
   };
   int i;*/
   struct proc *p;
+  struct memstat st;
   //char *state;
   //uint pc[10];
 
@@ -685,4 +1061,10 @@ procdump(void)
     }*/
 
   }
+  kmemstat(&st);
+  cprintf("\nframes: %d total, %d free (%d zeroed), %d used\n",
+          st.total, st.free, st.zeroed, st.used);
+  cprintf("used by: user %d, page tables %d, kstacks %d, pipes %d, "
+          "bcache %d, slab %d, other %d\n", st.user, st.pgtab, st.kstack,
+          st.pipe, st.bcache, st.slab, st.other);
 }
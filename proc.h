@@ -3,6 +3,9 @@
 
 #define MAX_PSYC_PAGES 15
 #define MAX_TOTAL_PAGES 30
+#define MAX_SWAP_PGTABS 2   // page-table pages a swap file can hold
+#define MAX_MADVISE 4       // madvise() ranges remembered per process
+#define MAX_PINNED_PAGES (MAX_PSYC_PAGES - 3) // mlock() limit per process
 
 // Per-CPU state
 struct cpu {
@@ -14,6 +17,9 @@ struct cpu {
   int ncli;                    // Depth of pushcli nesting.
   int intena;                  // Were interrupts enabled before pushcli?
   struct proc *proc;           // The process running on this cpu or null
+  pde_t *pgdir;                // User page table in %cr3, or null
+  int pgdirdead;               // pgdir was freed while loaded here
+  volatile int tlbstale;       // a T_TLBFLUSH for pgdir is on its way
 };
 
 extern struct cpu cpus[NCPU];
@@ -41,10 +47,17 @@ struct context {
 enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 struct swpdPages {
-  uint swaploc;
+  uint swaploc;                // non-zero if paged out by swapOutProc()
   char *virtualAddress;
 };
 
+// Access-pattern advice from madvise() for [start, end).
+struct madvRange {
+  uint start;
+  uint end;
+  int advice;
+};
+
 struct emptyPages {
   char *virtualAddress;
   struct emptyPages *next;
@@ -62,6 +75,7 @@ struct proc {
   struct proc *parent;         // Parent process
   struct trapframe *tf;        // Trap frame for current syscall
   struct context *context;     // swtch() here to run process
+  struct cpu *lastcpu;         // CPU that last loaded pgdir for us
   void *chan;                  // If non-zero, sleeping on chan
   int killed;                  // If non-zero, have been killed
   struct file *ofile[NOFILE];  // Open files
@@ -72,11 +86,17 @@ struct proc {
 
   int pagesInPhyMem;             // No. of pages in physical memory
   int pagesInSwapFile;        // No. of pages in swap file
-  struct emptyPages pagesFreedARR[MAX_PSYC_PAGES];  // Pre-allocated space for the pages in physical memory linked list
-  struct swpdPages pagesSwappedARR[MAX_PSYC_PAGES];// Pre-allocated space for the pages in swap file array
+  int pagesPinned;            // No. of pages pinned in memory by mlock()
+  struct emptyPages *pagesFreedARR;  // MAX_PSYC_PAGES entries for the pages in physical memory linked list
+  struct swpdPages *pagesSwappedARR; // MAX_PSYC_PAGES entries for the pages in swap file array
   struct emptyPages *head;        // Head of the pages in physical memory linked list
   struct emptyPages *tail;        // End of the pages in physical memory linked list
-
+  int suspended;                  // If non-zero, swapped out by load control
+  int swappedout;                 // If non-zero, whole process is in its swap file
+  int pagingio;                   // Swap file transfers in progress
+  uint sleepticks;                // ticks when the process last went to sleep
+  int pgtabSwapped[MAX_SWAP_PGTABS]; // PDX of each paged-out page table, or -1
+  struct madvRange madv[MAX_MADVISE]; // madvise() advice in effect
 
 };
 
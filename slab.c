@@ -0,0 +1,173 @@
+// Slab allocator for kernel objects smaller than a page.
+//
+// A slabcache hands out objects of one size.  The objects are carved
+// out of slabs: pages from kalloc() that start with a struct slab
+// header and chain their free objects through the objects' first
+// word.  The cache keeps the slabs that have free objects on a list,
+// and gives a slab back to kfree() once all its objects are free,
+// unless it is the last one.
+//
+// In front of the slabs every CPU keeps a magazine of up to SLABMAG
+// free objects, so that most slaballoc()/slabfree() calls run with
+// interrupts off and without the cache lock.  An empty magazine is
+// refilled, and a full one drained, SLABMAG/2 objects at a time.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "memstat.h"
+
+#define NSLABCACHE 8   // caches in the system
+#define SLABMAG    8   // objects in a per-CPU magazine
+
+struct slab {
+  struct slab *next;           // on the cache's list of partial slabs
+  struct slab *prev;
+  int inuse;                   // objects handed out
+  char *free;                  // first free object
+};
+
+struct slabcache {
+  struct spinlock lock;
+  char *name;
+  uint size;                   // object size, a multiple of 4
+  int perslab;                 // objects in one slab
+  int tag;                     // MT_* tag for the cache's pages
+  struct slab partial;         // circular list of slabs with free objects
+  struct {
+    int n;
+    void *obj[SLABMAG];
+  } mag[NCPU];
+};
+
+static struct slabcache caches[NSLABCACHE];
+static int ncaches;
+
+// Create a cache of size-byte objects whose pages are accounted as tag
+// (see memstat.h).  Caches are created while the kernel initializes
+// its subsystems and never destroyed.
+struct slabcache*
+slabcreate(char *name, uint size, int tag)
+{
+  struct slabcache *c;
+
+  size = (size + 3) & ~3;
+  if(size < sizeof(char*))
+    size = sizeof(char*);
+  if(ncaches == NSLABCACHE || size > PGSIZE - sizeof(struct slab))
+    panic("slabcreate");
+  c = &caches[ncaches++];
+  initlock(&c->lock, name);
+  c->name = name;
+  c->size = size;
+  c->perslab = (PGSIZE - sizeof(struct slab)) / size;
+  c->tag = tag;
+  c->partial.next = c->partial.prev = &c->partial;
+  return c;
+}
+
+static void
+slablink(struct slabcache *c, struct slab *s)
+{
+  s->next = c->partial.next;
+  s->prev = &c->partial;
+  c->partial.next->prev = s;
+  c->partial.next = s;
+}
+
+static void
+slabunlink(struct slab *s)
+{
+  s->prev->next = s->next;
+  s->next->prev = s->prev;
+}
+
+// Take one object from c's slabs, adding a slab if none has a free
+// object.  Caller holds c->lock.
+static void*
+slabget(struct slabcache *c)
+{
+  struct slab *s;
+  char *obj;
+  int i;
+
+  s = c->partial.next;
+  if(s == &c->partial){
+    if((s = (struct slab*)kalloc()) == 0)
+      return 0;
+    frametag((char*)s, c->tag);
+    s->inuse = 0;
+    s->free = 0;
+    obj = (char*)(s + 1);
+    for(i = 0; i < c->perslab; i++, obj += c->size){
+      *(char**)obj = s->free;
+      s->free = obj;
+    }
+    slablink(c, s);
+  }
+  obj = s->free;
+  s->free = *(char**)obj;
+  if(++s->inuse == c->perslab)
+    slabunlink(s);
+  return obj;
+}
+
+// Return obj to its slab.  Caller holds c->lock.
+static void
+slabput(struct slabcache *c, void *obj)
+{
+  struct slab *s;
+
+  s = (struct slab*)PGROUNDDOWN((uint)obj);
+  if(s->inuse == c->perslab)
+    slablink(c, s);
+  *(char**)obj = s->free;
+  s->free = obj;
+  if(--s->inuse == 0 && (c->partial.next != s || s->next != &c->partial)){
+    slabunlink(s);
+    kfree((char*)s);
+  }
+}
+
+// Allocate an object from c.  Its contents are undefined.
+// Returns 0 if no memory could be had.
+void*
+slaballoc(struct slabcache *c)
+{
+  void *obj;
+  int i;
+
+  pushcli();
+  i = cpuid();
+  if(c->mag[i].n == 0){
+    acquire(&c->lock);
+    while(c->mag[i].n < SLABMAG/2 && (obj = slabget(c)) != 0)
+      c->mag[i].obj[c->mag[i].n++] = obj;
+    release(&c->lock);
+  }
+  obj = 0;
+  if(c->mag[i].n > 0)
+    obj = c->mag[i].obj[--c->mag[i].n];
+  popcli();
+  return obj;
+}
+
+// Free an object allocated from c.
+void
+slabfree(struct slabcache *c, void *obj)
+{
+  int i;
+
+  pushcli();
+  i = cpuid();
+  if(c->mag[i].n == SLABMAG){
+    acquire(&c->lock);
+    while(c->mag[i].n > SLABMAG/2)
+      slabput(c, c->mag[i].obj[--c->mag[i].n]);
+    release(&c->lock);
+  }
+  c->mag[i].obj[c->mag[i].n++] = obj;
+  popcli();
+}
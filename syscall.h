@@ -20,3 +20,8 @@
 #define SYS_link   19
 #define SYS_mkdir  20
 #define SYS_close  21
+#define SYS_mempressure 22
+#define SYS_madvise 23
+#define SYS_mlock  24
+#define SYS_munlock 25
+#define SYS_memstat 26
@@ -6,6 +6,7 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "proc.h"
+#include "memstat.h"
 
 int
 sys_fork(void)
@@ -77,6 +78,65 @@ sys_sleep(void)
   return 0;
 }
 
+// Block until memory pressure reaches at least the given level
+// (see memstat.h) and return the level at that moment, or -1 for a
+// level that does not exist.
+int
+sys_mempressure(void)
+{
+  int level;
+
+  if(argint(0, &level) < 0)
+    return -1;
+  return mempressurewait(level);
+}
+
+// Advise the kernel how [addr, addr+len) will be used (see mman.h).
+int
+sys_madvise(void)
+{
+  int addr, len, advice;
+
+  if(argint(0, &addr) < 0 || argint(1, &len) < 0 || argint(2, &advice) < 0)
+    return -1;
+  if(len < 0)
+    return -1;
+  return madvise(addr, len, advice);
+}
+
+// Pin [addr, addr+len) in memory so that it is never paged out.
+int
+sys_mlock(void)
+{
+  int addr, len;
+
+  if(argint(0, &addr) < 0 || argint(1, &len) < 0 || len < 0)
+    return -1;
+  return mlock(addr, len);
+}
+
+int
+sys_munlock(void)
+{
+  int addr, len;
+
+  if(argint(0, &addr) < 0 || argint(1, &len) < 0 || len < 0)
+    return -1;
+  return munlock(addr, len);
+}
+
+// Copy the physical memory accounting (see memstat.h) to user space.
+int
+sys_memstat(void)
+{
+  struct memstat *st;
+
+  if(argptr(0, (void*)&st, sizeof(*st)) < 0)
+    return -1;
+  kmemstat(st);
+  return 0;
+}
+
 // return how many clock tick interrupts have occurred
 // since start.
 int
@@ -38,7 +38,6 @@ void
 trap(struct trapframe *tf)
 {
   uint addr;
-  pde_t *vaddr;
   if(tf->trapno == T_SYSCALL){
     if(myproc()->killed)
       exit();
@@ -74,6 +73,11 @@ trap(struct trapframe *tf)
     uartintr();
     lapiceoi();
     break;
+  case T_TLBFLUSH:
+    mycpu()->tlbstale = 0;
+    lcr3(rcr3());
+    lapiceoi();
+    break;
   case T_IRQ0 + 7:
   case T_IRQ0 + IRQ_SPURIOUS:
     cprintf("cpu%d: spurious interrupt at %x:%x\n",
@@ -82,16 +86,11 @@ trap(struct trapframe *tf)
     break;
   case T_PGFLT:
     addr = rcr2();
-    vaddr = &myproc()->pgdir[PDX(addr)];
-    if(DEBUG) cprintf("addr:0x%x vaddr:0x%x PDX:0x%x PTX:0x%x FLAGS:0x%x\n", addr, vaddr, PDX(*vaddr),PTX(*vaddr),PTE_FLAGS(*vaddr)); 
-    if(DEBUG) cprintf("&PTE_PG:%x &PTE_P:%x\n", (((uint*)PTE_ADDR(P2V(*vaddr)))[PTX(addr)] & PTE_PG), ((((uint*)PTE_ADDR(P2V(*vaddr)))[PTX(addr)] & PTE_P)));
-    if (((int)(*vaddr) & PTE_P) != 0) { // if page table isn't present at page directory -> hard page fault
-      if (((uint*)PTE_ADDR(P2V(*vaddr)))[PTX(addr)] & PTE_PG) { // if the page is in the process's swap file
-        if(DEBUG) cprintf("page is in swap file, pid %d, va %p\n", myproc()->pid, addr); 
-        swapPages(PTE_ADDR(addr));
-        return;
-      }
-    }
+    if(DEBUG && myproc()) cprintf("page fault, pid %d, va %p err %d\n", myproc()->pid, addr, tf->err);
+    // Paged out or merged; a process that could not get the page
+    // has been killed and exits below.
+    if(myproc() && pageFault(addr, tf->err & FEC_WR) == 0)
+      break;
   //PAGEBREAK: 13
   default:
     if(myproc() == 0 || (tf->cs&3) == 0){
@@ -114,6 +113,11 @@ trap(struct trapframe *tf)
   if(myproc() && myproc()->killed && (tf->cs&3) == DPL_USER)
     exit();
 
+  // Load control picked this process to make room; swap it out
+  // and park it until the fault rate comes down.
+  if(myproc() && myproc()->suspended && (tf->cs&3) == DPL_USER)
+    suspend();
+
   // Force process to give up CPU on clock tick.
   // If interrupts were on while locks held, would need to check nlock.
   if(myproc() && myproc()->state == RUNNING &&
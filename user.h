@@ -1,5 +1,6 @@
 struct stat;
 struct rtcdate;
+struct memstat;
 
 // system calls
 int fork(void);
@@ -23,6 +24,11 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int mempressure(int);
+int madvise(void*, uint, int);
+int mlock(void*, uint);
+int munlock(void*, uint);
+int memstat(struct memstat*);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -7,6 +7,9 @@
 #include "syscall.h"
 #include "traps.h"
 #include "memlayout.h"
+#include "memstat.h"
+#include "mmu.h"
+#include "mman.h"
 
 char buf[8192];
 char name[3];
@@ -457,6 +460,167 @@ mem(void)
   }
 }
 
+// grow by n pages and return the first, page aligned,
+// as madvise() and mlock() want.
+char*
+pagealloc(int n)
+{
+  char *p;
+
+  p = sbrk(0);
+  sbrk(PGROUNDUP((uint)p) - (uint)p);
+  p = sbrk(n*PGSIZE);
+  if(p == (char*)-1){
+    printf(stdout, "sbrk %d pages failed\n", n);
+    exit();
+  }
+  return p;
+}
+
+// does MADV_DONTNEED throw the contents away, in memory
+// and in swap, so that the pages read back as zeroes?
+void
+madvisetest(void)
+{
+  char *p;
+  int i, n, pid;
+
+  printf(stdout, "madvise test\n");
+  if((pid = fork()) == 0){
+    // more than a process keeps in memory, so some are swapped out.
+    n = 16;
+    p = pagealloc(n);
+    memset(p, 'x', n*PGSIZE);
+    if(madvise(p, n*PGSIZE, MADV_DONTNEED) < 0){
+      printf(stdout, "madvise failed\n");
+      exit();
+    }
+    for(i = 0; i < n*PGSIZE; i++){
+      if(p[i] != 0){
+        printf(stdout, "madvise: byte %d is %d, not 0\n", i, p[i]);
+        exit();
+      }
+    }
+    // the guard page below the stack stays inaccessible.
+    p = (char*)(((uint)&i & ~(PGSIZE-1)) - PGSIZE);
+    if(madvise(p, PGSIZE, MADV_DONTNEED) == 0){
+      printf(stdout, "madvise of the guard page succeeded\n");
+      exit();
+    }
+    printf(stdout, "madvise test ok\n");
+    exit();
+  }
+  wait();
+}
+
+// MAX_PINNED_PAGES in proc.h
+#define PINNED 12
+
+// does mlock() keep pages in memory under swap pressure,
+// refuse to pin more than PINNED pages, and does munlock()
+// undo it?  a pinned page is one MADV_DONTNEED leaves alone.
+void
+mlocktest(void)
+{
+  char *p, *q;
+  int i, j, n, pid;
+
+  printf(stdout, "mlock test\n");
+  if((pid = fork()) == 0){
+    n = PINNED + 1;
+    p = pagealloc(n);
+    memset(p, 0, n*PGSIZE);
+
+    if(mlock(p, n*PGSIZE) == 0){
+      printf(stdout, "mlock of %d pages succeeded\n", n);
+      exit();
+    }
+    // runs into the guard page below the stack after pinning the
+    // page under it; the quota must be whole afterwards.
+    q = (char*)(((uint)&i & ~(PGSIZE-1)) - 2*PGSIZE);
+    if(mlock(q, 2*PGSIZE) == 0){
+      printf(stdout, "mlock of the guard page succeeded\n");
+      exit();
+    }
+    if(mlock(p, PINNED*PGSIZE) < 0){
+      printf(stdout, "mlock of %d pages failed\n", PINNED);
+      exit();
+    }
+    if(mlock(p + PINNED*PGSIZE, PGSIZE) == 0){
+      printf(stdout, "mlock past the limit succeeded\n");
+      exit();
+    }
+    if(munlock(p, n*PGSIZE) < 0){
+      printf(stdout, "munlock failed\n");
+      exit();
+    }
+
+    // pin two pages, then page the rest in and out.
+    memset(p, 'p', 2*PGSIZE);
+    if(mlock(p, 2*PGSIZE) < 0){
+      printf(stdout, "mlock failed\n");
+      exit();
+    }
+    for(j = 0; j < 4; j++)
+      for(i = 2; i < n; i++)
+        p[i*PGSIZE] = j;
+    madvise(p, 2*PGSIZE, MADV_DONTNEED);
+    for(i = 0; i < 2*PGSIZE; i++){
+      if(p[i] != 'p'){
+        printf(stdout, "mlock: pinned page lost its contents\n");
+        exit();
+      }
+    }
+
+    if(munlock(p, 2*PGSIZE) < 0){
+      printf(stdout, "munlock failed\n");
+      exit();
+    }
+    madvise(p, 2*PGSIZE, MADV_DONTNEED);
+    for(i = 0; i < 2*PGSIZE; i++){
+      if(p[i] != 0){
+        printf(stdout, "munlock: page still pinned\n");
+        exit();
+      }
+    }
+    printf(stdout, "mlock test ok\n");
+    exit();
+  }
+  wait();
+}
+
+// do memstat()'s counts add up?  idle CPUs zero free pages
+// while it looks, so allow a few tries for an exact match.
+void
+memstattest(void)
+{
+  struct memstat st;
+  uint sum;
+  int i;
+
+  printf(stdout, "memstat test\n");
+  for(i = 0; i < 10; i++){
+    if(memstat(&st) < 0){
+      printf(stdout, "memstat failed\n");
+      exit();
+    }
+    if(st.used != st.total - st.free || st.zeroed > st.free ||
+       st.user == 0 || st.kstack == 0){
+      printf(stdout, "memstat: bad counts\n");
+      exit();
+    }
+    sum = st.user + st.pgtab + st.kstack + st.pipe + st.bcache +
+          st.slab + st.other;
+    if(sum == st.used)
+      break;
+  }
+  if(i == 10){
+    printf(stdout, "memstat: %d pages by use, %d used\n", sum, st.used);
+    exit();
+  }
+  printf(stdout, "memstat test ok\n");
+}
+
 // More file system tests
 
 // two processes write to the same file descriptor
@@ -1606,6 +1770,183 @@ bsstest(void)
   printf(stdout, "bss test ok\n");
 }
 
+// do processes that thrash all get to finish, with their
+// memory intact, when load control suspends some of them
+// and resumes them later?
+void
+loadctltest(void)
+{
+  char *p;
+  int i, j, k, n, pid, ppid;
+
+  printf(stdout, "load control test\n");
+  ppid = getpid();
+  n = 10;
+  for(i = 0; i < 3; i++){
+    pid = fork();
+    if(pid < 0){
+      printf(stdout, "fork failed\n");
+      exit();
+    }
+    if(pid == 0){
+      // more pages than stay resident, touched in turn,
+      // so that nearly every touch is a swap fault.
+      p = sbrk(n*4096);
+      if(p == (char*)-1){
+        printf(stdout, "sbrk failed\n");
+        kill(ppid);
+        exit();
+      }
+      for(k = 0; k < n; k++)
+        p[k*4096] = k;
+      for(j = 1; j < 30; j++){
+        for(k = 0; k < n; k++){
+          if(p[k*4096] != (char)(j - 1 + k)){
+            printf(stdout, "load control: page %d lost its contents\n", k);
+            kill(ppid);
+            exit();
+          }
+          p[k*4096] = j + k;
+        }
+      }
+      exit();
+    }
+  }
+  for(i = 0; i < 3; i++)
+    wait();
+  printf(stdout, "load control test ok\n");
+}
+
+// does growing past what the swap file can hold fail sbrk()
+// instead of the kernel, and leave the pages already had intact?
+void
+swapfulltest(void)
+{
+  char *p, *a;
+  int i, n, pid, ppid;
+
+  printf(stdout, "swap full test\n");
+  ppid = getpid();
+  if((pid = fork()) == 0){
+    p = sbrk(0);
+    for(n = 0; n < 100; n++){
+      if((a = sbrk(4096)) == (char*)-1)
+        break;
+      a[0] = n;
+    }
+    if(n == 100){
+      printf(stdout, "swap full: sbrk never failed\n");
+      kill(ppid);
+      exit();
+    }
+    for(i = 0; i < n; i++){
+      if(p[i*4096] != (char)i){
+        printf(stdout, "swap full: page %d lost its contents\n", i);
+        kill(ppid);
+        exit();
+      }
+    }
+    exit();
+  }
+  wait();
+  printf(stdout, "swap full test ok\n");
+}
+
+// does mempressure() return the current level at once when
+// asked for MEM_OK, and keep a caller waiting for a level that
+// memory has not reached?
+void
+mempressuretest(void)
+{
+  int level, n, pid, fds[2];
+  char c;
+
+  printf(stdout, "mempressure test\n");
+  level = mempressure(MEM_OK);
+  if(level < MEM_OK || level > MEM_CRITICAL){
+    printf(stdout, "mempressure: bad level %d\n", level);
+    exit();
+  }
+  if(mempressure(MEM_OK - 1) != -1 || mempressure(MEM_CRITICAL + 1) != -1){
+    printf(stdout, "mempressure: accepted a level that does not exist\n");
+    exit();
+  }
+  if(level == MEM_CRITICAL){
+    printf(stdout, "mempressure test ok (memory already critical)\n");
+    return;
+  }
+  if(pipe(fds) != 0){
+    printf(stdout, "pipe() failed\n");
+    exit();
+  }
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    close(fds[0]);
+    c = mempressure(MEM_CRITICAL);
+    write(fds[1], &c, 1);
+    exit();
+  }
+  close(fds[1]);
+  sleep(50);
+  kill(pid);
+  wait();
+  n = read(fds[0], &c, 1);
+  close(fds[0]);
+  if(n != 0){
+    printf(stdout, "mempressure: returned %d below MEM_CRITICAL\n", c);
+    exit();
+  }
+  printf(stdout, "mempressure test ok\n");
+}
+
+// do pages that kswapd merges stay private to each process
+// once written?  two processes fill pages with the same bytes,
+// sleep through some merging passes, then write their own.
+void
+ksmtest(void)
+{
+  char *p;
+  int i, k, n, pid, ppid;
+
+  printf(stdout, "ksm test\n");
+  ppid = getpid();
+  n = 8;
+  for(i = 0; i < 2; i++){
+    pid = fork();
+    if(pid < 0){
+      printf(stdout, "fork failed\n");
+      exit();
+    }
+    if(pid == 0){
+      p = sbrk(n*4096);
+      if(p == (char*)-1){
+        printf(stdout, "sbrk failed\n");
+        kill(ppid);
+        exit();
+      }
+      memset(p, 'k', n*4096);
+      sleep(3*KSM_INTERVAL);
+      for(k = 0; k < n; k += 2)
+        memset(p + k*4096, '0' + i, 4096);
+      for(k = 0; k < n*4096; k++){
+        if(p[k] != ((k/4096) % 2 ? 'k' : '0' + i)){
+          printf(stdout, "ksm: byte %d is %d\n", k, p[k]);
+          kill(ppid);
+          exit();
+        }
+      }
+      exit();
+    }
+  }
+  for(i = 0; i < 2; i++)
+    wait();
+  printf(stdout, "ksm test ok\n");
+}
+
 // does exec return an error if the arguments
 // are larger than a page? or does it write
 // below the stack and wreck the instructions/data?
@@ -1780,6 +2121,9 @@ main(int argc, char *argv[])
   iputtest();
 
   mem();
+  madvisetest();
+  mlocktest();
+  memstattest();
   pipe1();
   preempt();
   exitwait();
@@ -1794,6 +2138,10 @@ main(int argc, char *argv[])
   iref();
   forktest();
   bigdir(); // slow
+  ksmtest();
+  mempressuretest();
+  swapfulltest();
+  loadctltest();
 
   uio();
 
@@ -5,7 +5,11 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "proc.h"
+#include "memstat.h"
+#include "spinlock.h"
 #include "elf.h"
+#include "traps.h"
+#include "mman.h"
 
 #define BUF_SIZE PGSIZE/4
 
@@ -13,6 +17,11 @@
 
 extern char data[];  // defined by kernel.ld
 pde_t *kpgdir;  // for use in scheduler()
+static struct spinlock lazylock;  // see loadpgdir()
+
+static int pgtabOut(struct proc*, uint);
+static int pgtabIn(struct proc*, uint);
+static void pgtabDrop(struct proc*, uint);
 
 struct segdesc gdt[NSEGS];
 
@@ -59,6 +68,16 @@ seginit(void)
 // Return the address of the PTE in page table pgdir
 // that corresponds to virtual address va.  If alloc!=0,
 // create any required page table pages.
+// If the page table is in the swap file and pgdir belongs to the
+// current process, it is read back first: walkpgdir() may then
+// allocate and sleep on disk I/O, and returns 0 if that fails, even
+// for an address that is mapped.  Callers holding a spinlock must
+// only pass other processes' page tables (ksmScan(), kswapd), for
+// which a paged-out table gives 0 without any I/O.
+// Only the kernel direct map uses 4Mbyte pages.  User memory never
+// does: a process keeps at most MAX_PSYC_PAGES frames resident, far
+// short of the 1024 a large page would pin, so there is nothing here
+// to split.
 static pte_t *
 walkpgdir(pde_t *pgdir, const void *va, int alloc)
 {
@@ -66,13 +85,21 @@ walkpgdir(pde_t *pgdir, const void *va, int alloc)
   pte_t *pgtab;
 
   pde = &pgdir[PDX(va)];
+  if(*pde & PTE_PS)
+    panic("walkpgdir: 4Mbyte page");
+  if((*pde & (PTE_P|PTE_PG)) == PTE_PG){
+    // Page table is in the swap file; only its owner reads it back.
+    if(myproc() == 0 || myproc()->pgdir != pgdir ||
+       pgtabIn(myproc(), PDX(va)) < 0)
+      return 0;
+  }
   if(*pde & PTE_P){
     pgtab = (pte_t*)P2V(PTE_ADDR(*pde));
   } else {
-    if(!alloc || (pgtab = (pte_t*)kalloc()) == 0)
+    // kalloczeroed() makes sure all those PTE_P bits are zero.
+    if(!alloc || (pgtab = (pte_t*)kalloczeroed()) == 0)
       return 0;
-    // Make sure all those PTE_P bits are zero.
-    memset(pgtab, 0, PGSIZE);
+    frametag((char*)pgtab, MT_PGTAB);
     // The permissions here are overly generous, but they can
     // be further restricted by the permissions in the page table
     // entries, if necessary.
@@ -98,6 +125,8 @@ mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
     if(*pte & PTE_P)
       panic("remap");
     *pte = pa | perm | PTE_P;
+    if(perm & PTE_U)
+      frameset(pa, pgdir, (uint)a);
     if(a == last)
       break;
     a += PGSIZE;
@@ -119,13 +148,21 @@ mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
 //   KERNBASE..KERNBASE+EXTMEM: mapped to 0..EXTMEM (for I/O space)
 //   KERNBASE+EXTMEM..data: mapped to EXTMEM..V2P(data)
 //                for the kernel's instructions and r/o data
-//   data..KERNBASE+PHYSTOP: mapped to V2P(data)..PHYSTOP,
+//   data..KERNBASE+physend: mapped to V2P(data)..physend,
 //                                  rw data + free physical memory
 //   0xfe000000..0: mapped direct (devices such as ioapic)
 //
 // The kernel allocates physical memory for its heap and for user memory
-// between V2P(end) and the end of physical memory (PHYSTOP)
-// (directly addressable from end..P2V(PHYSTOP)).
+// between V2P(end) and the end of physical memory (physend, at most
+// PHYSTOP) (directly addressable from end..P2V(physend)).
+
+// PTE_G if the CPU has global pages.  Kernel mappings are the same in
+// every page table, so marking them global keeps them in the TLB
+// across the %cr3 loads of a process switch.
+static int kpte_g;
+
+// Non-zero if the CPU has 4Mbyte pages (entry.S already set CR4.PSE).
+static int kpse;
 
 // This table defines the kernel's mappings, which are present in
 // every process's page table.
@@ -137,10 +174,41 @@ static struct kmap {
 } kmap[] = {
  { (void*)KERNBASE, 0,             EXTMEM,    PTE_W}, // I/O space
  { (void*)KERNLINK, V2P(KERNLINK), V2P(data), 0},     // kern text+rodata
- { (void*)data,     V2P(data),     PHYSTOP,   PTE_W}, // kern data+memory
+ { (void*)data,     V2P(data),     0,         PTE_W}, // kern data+memory
+                                                      // (end set by kvmalloc)
  { (void*)DEVSPACE, DEVSPACE,      0,         PTE_W}, // more devices
 };
 
+// Map one kmap region into pgdir, with 4Mbyte pages for the parts
+// that are 4Mbyte aligned in both address spaces and 4Kbyte pages
+// for the rest.  k->phys_end may be 0 for a region that runs to the
+// top of memory.
+static int
+kmapregion(pde_t *pgdir, struct kmap *k)
+{
+  uint a, pa, size, n;
+
+  a = (uint)k->virt;
+  pa = k->phys_start;
+  size = k->phys_end - k->phys_start;
+  while(size > 0){
+    if(kpse && a % PDSIZE == 0 && pa % PDSIZE == 0 && size >= PDSIZE){
+      pgdir[PDX(a)] = pa | k->perm | kpte_g | PTE_P | PTE_PS;
+      n = PDSIZE;
+    } else {
+      n = PDSIZE - a % PDSIZE;
+      if(n > size)
+        n = size;
+      if(mappages(pgdir, (void*)a, n, pa, k->perm | kpte_g) < 0)
+        return -1;
+    }
+    a += n;
+    pa += n;
+    size -= n;
+  }
+  return 0;
+}
+
 // Set up kernel part of a page table.
 pde_t*
 setupkvm(void)
@@ -148,14 +216,13 @@ setupkvm(void)
   pde_t *pgdir;
   struct kmap *k;
 
-  if((pgdir = (pde_t*)kalloc()) == 0)
+  if((pgdir = (pde_t*)kalloczeroed()) == 0)
     return 0;
-  memset(pgdir, 0, PGSIZE);
+  frametag((char*)pgdir, MT_PGTAB);
   if (P2V(PHYSTOP) > (void*)DEVSPACE)
     panic("PHYSTOP too high");
   for(k = kmap; k < &kmap[NELEM(kmap)]; k++)
-    if(mappages(pgdir, k->virt, k->phys_end - k->phys_start,
-                (uint)k->phys_start, k->perm) < 0) {
+    if(kmapregion(pgdir, k) < 0) {
       freevm(pgdir);
       return 0;
     }
@@ -167,8 +234,33 @@ setupkvm(void)
 void
 kvmalloc(void)
 {
+  uint edx;
+  struct kmap *k;
+
+  cpuinfo(1, 0, 0, 0, &edx);
+  if(edx & CPUID_PGE)
+    kpte_g = PTE_G;
+  if(edx & CPUID_PSE)
+    kpse = 1;
+  // Every page table maps all of RAM; with 4Kbyte pages that costs a
+  // page-table page per 4Mbyte in each process, so use less RAM.
+  if(!kpse && physend > PHYSLOW)
+    physend = PHYSLOW;
+  for(k = kmap; k < &kmap[NELEM(kmap)]; k++)
+    if(k->virt == data)
+      k->phys_end = physend;
+  initlock(&lazylock, "lazytlb");
   kpgdir = setupkvm();
   switchkvm();
+  pgeinit();
+}
+
+// Let this CPU keep global kernel mappings across %cr3 loads.
+void
+pgeinit(void)
+{
+  if(kpte_g)
+    lcr4(rcr4() | CR4_PGE);
 }
 
 // Switch h/w page table register to the kernel-only page table,
@@ -179,9 +271,54 @@ switchkvm(void)
   lcr3(V2P(kpgdir));   // switch to the kernel page table
 }
 
-// Switch TSS and h/w page table to correspond to process p.
-void
-switchuvm(struct proc *p)
+// The scheduler leaves the last process's page table in %cr3 rather
+// than loading kpgdir, since the kernel half is the same everywhere,
+// and only reloads it for a different address space.  lazylock
+// guards cpu->pgdir and cpu->pgdirdead, so that freevm() never frees
+// a page directory some CPU still has loaded: the last such CPU
+// frees it when it next switches.
+
+// Free pgdir and its page-table pages; the user pages must be gone.
+static void
+freepgtabs(pde_t *pgdir)
+{
+  uint i;
+
+  for(i = 0; i < NPDENTRIES; i++){
+    if((pgdir[i] & (PTE_P|PTE_PS)) == PTE_P){
+      char * v = P2V(PTE_ADDR(pgdir[i]));
+      kfree(v);
+    }
+  }
+  kfree((char*)pgdir);
+}
+
+// Load pgdir into %cr3 on this CPU, freeing the page directory it
+// replaces if that one died while loaded.  Interrupts must be off.
+static void
+loadpgdir(pde_t *pgdir)
+{
+  struct cpu *c, *me;
+  pde_t *old;
+  int dead;
+
+  acquire(&lazylock);
+  me = mycpu();
+  old = me->pgdir;
+  dead = me->pgdirdead;
+  lcr3(V2P(pgdir));
+  me->pgdir = pgdir;
+  me->pgdirdead = 0;
+  for(c = cpus; dead && c < cpus+ncpu; c++)
+    if(c->pgdir == old)
+      dead = 0;
+  release(&lazylock);
+  if(dead)
+    freepgtabs(old);
+}
+
+static void
+switchto(struct proc *p, int lazy)
 {
   if(p == 0)
     panic("switchuvm: no process");
@@ -200,7 +337,59 @@ switchuvm(struct proc *p)
   // forbids I/O instructions (e.g., inb and outb) from user space
   mycpu()->ts.iomb = (ushort) 0xFFFF;
   ltr(SEG_TSS << 3);
-  lcr3(V2P(p->pgdir));  // switch to process's address space
+  // If p last ran here and its page table is still loaded, nothing
+  // has touched p's mappings since without a tlbshootdown(), whose
+  // flush this CPU may not have taken yet.
+  if(!lazy || mycpu()->pgdir != p->pgdir || p->lastcpu != mycpu() ||
+     mycpu()->tlbstale){
+    mycpu()->tlbstale = 0;
+    loadpgdir(p->pgdir);  // switch to process's address space
+  }
+  p->lastcpu = mycpu();
+  popcli();
+}
+
+// Switch TSS and h/w page table to correspond to process p.
+void
+switchuvm(struct proc *p)
+{
+  switchto(p, 0);
+}
+
+// Switch to p from the scheduler, keeping %cr3 when it already
+// holds p's page table.
+void
+resumeuvm(struct proc *p)
+{
+  switchto(p, 1);
+}
+
+// Drop the TLB entry for va after its PTE in pgdir changed.  The
+// local entry goes with invlpg; any other CPU with pgdir loaded is
+// marked tlbstale and gets a T_TLBFLUSH interrupt to reload %cr3.
+// The remote flush is not waited for: a CPU waiting with interrupts
+// off could deadlock against one spinning on a lock we hold.  It does
+// not need to be.  Only the process itself, on this CPU, or kswapd,
+// while the process cannot run, change a process's PTEs, so another
+// CPU with pgdir loaded is idle in the scheduler and does not touch
+// user memory.  Before it runs the process again, switchto() sees
+// tlbstale and reloads %cr3, so the caller may free the old frame
+// at once.  A pgdir that is not loaded anywhere costs nothing.
+void
+tlbshootdown(pde_t *pgdir, uint va)
+{
+  struct cpu *c, *me;
+
+  pushcli();
+  me = mycpu();
+  if(me->pgdir == pgdir)
+    invlpg((void*)va);
+  for(c = cpus; c < cpus+ncpu; c++){
+    if(c != me && c->pgdir == pgdir){
+      c->tlbstale = 1;
+      lapicipi(c->apicid, T_TLBFLUSH);
+    }
+  }
   popcli();
 }
 
@@ -213,8 +402,7 @@ inituvm(pde_t *pgdir, char *init, uint sz)
 
   if(sz >= PGSIZE)
     panic("inituvm: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloczeroed();
   mappages(pgdir, 0, PGSIZE, V2P(mem), PTE_W|PTE_U);
   memmove(mem, init, sz);
 }
@@ -243,20 +431,95 @@ loaduvm(pde_t *pgdir, char *addr, struct inode *ip, uint offset, uint sz)
   return 0;
 }
 
-void fifoEntryRecord(char *va){
+// Push va onto the head (newest end) of p's resident page list.
+static void
+fifoRecord(struct proc *p, char *va)
+{
   int i;
   if(PRINT_DEBUG)
-    cprintf("rnp pid:%d count:%d va:0x%x\n", myproc()->pid, myproc()->pagesInPhyMem, va);
+    cprintf("rnp pid:%d count:%d va:0x%x\n", p->pid, p->pagesInPhyMem, va);
   for (i = 0; i < MAX_PSYC_PAGES; i++)
-    if (myproc()->pagesFreedARR[i].virtualAddress == (char*)0xffffffff)
+    if (p->pagesFreedARR[i].virtualAddress == (char*)0xffffffff)
       goto foundrnp;
   if(PRINT_DEBUG)
-    cprintf("panic follows, pid:%d, name:%s\n", myproc()->pid, myproc()->name);
+    cprintf("panic follows, pid:%d, name:%s\n", p->pid, p->name);
   panic("NewPageRecord: no free pages");
 foundrnp:
-  myproc()->pagesFreedARR[i].virtualAddress = va;
-  myproc()->pagesFreedARR[i].next = myproc()->head;
-  myproc()->head = &myproc()->pagesFreedARR[i];
+  p->pagesFreedARR[i].virtualAddress = va;
+  p->pagesFreedARR[i].next = p->head;
+  p->head = &p->pagesFreedARR[i];
+}
+
+void fifoEntryRecord(char *va){
+  fifoRecord(myproc(), va);
+}
+
+// Take va off p's resident page list.
+static void
+fifoRemove(struct proc *p, char *va)
+{
+  struct emptyPages **pp, *l;
+
+  for (pp = &p->head; *pp != 0; pp = &(*pp)->next)
+    if ((*pp)->virtualAddress == va)
+      goto found;
+  panic("deallocuvm: entry not found in proc->pagesFreedARR");
+found:
+  l = *pp;
+  *pp = l->next;
+  l->virtualAddress = (char*) 0xffffffff;
+  l->next = 0;
+  p->pagesInPhyMem--;
+}
+
+// Move va to the tail of p's resident page list, so that it is the
+// next page FIFO replacement picks.
+static void
+fifoDemote(struct proc *p, char *va)
+{
+  struct emptyPages **pp, *l;
+
+  for (pp = &p->head; *pp != 0; pp = &(*pp)->next)
+    if ((*pp)->virtualAddress == va)
+      break;
+  if (*pp == 0 || (*pp)->next == 0)
+    return;
+  l = *pp;
+  *pp = l->next;
+  while (*pp != 0)
+    pp = &(*pp)->next;
+  *pp = l;
+  l->next = 0;
+}
+
+// Find the oldest resident page of p that mlock() has not pinned.
+// Returns the link that points at its list entry, or 0.
+static struct emptyPages **
+fifoVictim(struct proc *p)
+{
+  struct emptyPages **pp, **victim;
+  pte_t *pte;
+
+  victim = 0;
+  for (pp = &p->head; *pp != 0; pp = &(*pp)->next) {
+    pte = walkpgdir(p->pgdir, (*pp)->virtualAddress, 0);
+    if (pte && (*pte & PTE_PIN) == 0)
+      victim = pp;
+  }
+  return victim;
+}
+
+// Return the index of the swap file slot holding va, or -1.
+// Pass (char*)0xffffffff to find a free slot.
+static int
+swapSlotFind(struct proc *p, char *va)
+{
+  int i;
+
+  for (i = 0; i < MAX_PSYC_PAGES; i++)
+    if (p->pagesSwappedARR[i].virtualAddress == va)
+      return i;
+  return -1;
 }
 
 
@@ -271,34 +534,31 @@ void NewPageRecord(char *va) {
 
 
 
+// Page out the oldest resident page and hand its list entry back to
+// the caller for reuse.  Returns 0 if the swap file is full or the
+// write fails; the process has then reached MAX_TOTAL_PAGES.
 struct emptyPages *fifoWrite() {
   int i;
-  struct emptyPages *temp, *l;
+  struct emptyPages **pp, *l;
   for (i = 0; i < MAX_PSYC_PAGES; i++){
     if (myproc()->pagesSwappedARR[i].virtualAddress == (char*)0xffffffff)
       goto foundswappedpageslot;
   }
-  panic("PageWriteInFile: FIFO no slot for swapped page");
+  return 0;
 foundswappedpageslot:
-  temp = myproc()->head;
-  if (temp == 0)
-    panic("fifoWrite: proc->head is NULL");
-  if (temp->next == 0)
-    panic("fifoWrite: single page in phys mem");
-  // find the before-last temp in the used pages list
-  while (temp->next->next != 0)
-    temp = temp->next;
-  l = temp->next;
-  temp->next = 0;
+  if ((pp = fifoVictim(myproc())) == 0)
+    return 0;
+  l = *pp;
 
   if(PRINT_DEBUG){
     cprintf("FIFO chose to page out page starting at 0x%x \n\n", l->virtualAddress);
   }
 
-  myproc()->pagesSwappedARR[i].virtualAddress = l->virtualAddress;
-  int num = 0;
-  if ((num = writeToSwapFile(myproc(), (char*)PTE_ADDR(l->virtualAddress), i * PGSIZE, PGSIZE)) == 0)
+  if (writeToSwapFile(myproc(), (char*)PTE_ADDR(l->virtualAddress), i * PGSIZE, PGSIZE) != PGSIZE)
     return 0;
+  *pp = l->next;
+  l->next = 0;
+  myproc()->pagesSwappedARR[i].virtualAddress = l->virtualAddress;
   pte_t *pte1 = walkpgdir(myproc()->pgdir, (void*)l->virtualAddress, 0);
   if (!*pte1)
     panic("PageWriteInFile: pte1 is empty");
@@ -306,11 +566,12 @@ foundswappedpageslot:
   // // if (!*pte2)
   // //   panic("PageWriteInFile: pte2 is empty");
   // *pte2 = PTE_ADDR(*pte1) | PTE_U | PTE_P | PTE_W;
-  kfree((char*)PTE_ADDR(P2V_WO(*walkpgdir(myproc()->pgdir, l->virtualAddress, 0))));
+  char *mem = (char*)PTE_ADDR(P2V_WO(*pte1));
   *pte1 = PTE_W | PTE_U | PTE_PG;
+  tlbshootdown(myproc()->pgdir, (uint)l->virtualAddress);
+  kfree(mem);
   ++myproc()->pagesInSwapFile;
   if(PRINT_DEBUG) cprintf("writePage:proc->pagesinswapfile:%d\n", myproc()->pagesInSwapFile);
-  lcr3(V2P(myproc()->pgdir));
   return l;
 }
 
@@ -319,6 +580,27 @@ struct emptyPages *PageWriteInFile(char* va) {
   return fifoWrite();
 }
 
+// kalloc() a frame for user memory, zero-filled if zero is set.  If
+// memory is exhausted, let the OOM killer pick a victim and wait up to
+// OOMWAIT ticks for it to give its frames back.  Must not be called
+// with spinlocks held.
+static char*
+allocUserPage(int zero)
+{
+  char *mem;
+  int i;
+
+  for (i = 0; ; i++) {
+    if ((mem = zero ? kalloczeroed() : kalloc()) != 0)
+      return mem;
+    if (i == OOMWAIT || oomkill() < 0 || myproc()->killed)
+      return 0;
+    acquire(&tickslock);
+    sleep(&ticks, &tickslock);
+    release(&tickslock);
+  }
+}
+
 // Allocate page tables and physical memory to grow process from oldsz to
 // newsz, which need not be page aligned.  Returns new size or 0 on error.
 int
@@ -337,12 +619,23 @@ allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
   a = PGROUNDUP(oldsz);
   for(; a < newsz; a += PGSIZE){
 
+    mem = allocUserPage(1);
+    if(mem == 0){
+      cprintf("allocuvm out of memory\n");
+      deallocuvm(pgdir, newsz, oldsz);
+      return 0;
+    }
+
     if(myproc()->pagesInPhyMem >= MAX_PSYC_PAGES) {
       
       if(PRINT_DEBUG) cprintf("writing to swap file, proc->name: %s, pagesinmem: %d\n", myproc()->name, myproc()->pagesInPhyMem);
 
-      if ((l = PageWriteInFile((char*)a)) == 0)
-        panic("allocuvm: error writing page to swap file");
+      if ((l = PageWriteInFile((char*)a)) == 0){
+        cprintf("allocuvm: swap file full\n");
+        kfree(mem);
+        deallocuvm(pgdir, newsz, oldsz);
+        return 0;
+      }
 
       //TODO: these FIFO specific steps don't belong here!
       // they should move to a FIFO specific functiom!
@@ -354,12 +647,6 @@ allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 
     }
 
-    mem = kalloc();
-    if(mem == 0){
-      cprintf("allocuvm out of memory\n");
-      deallocuvm(pgdir, newsz, oldsz);
-      return 0;
-    }
     if (newpage){
       //TODO delete 
       if(PRINT_DEBUG) cprintf("\nnewpage = 1\n");
@@ -367,7 +654,6 @@ allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
       if(PRINT_DEBUG) cprintf("recorded new page, proc->name: %s, pagesinmem: %d\n", myproc()->name, myproc()->pagesInPhyMem);
       NewPageRecord((char*)a);
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pgdir, (char*)a, PGSIZE, V2P(mem), PTE_W|PTE_U) < 0){
       cprintf("allocuvm out of memory (2)\n");
       deallocuvm(pgdir, newsz, oldsz);
@@ -394,6 +680,13 @@ deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 
   a = PGROUNDUP(newsz);
   for(; a  < oldsz; a += PGSIZE){
+    if((pgdir[PDX(a)] & (PTE_P|PTE_PG)) == PTE_PG && myproc()->pgdir == pgdir &&
+       PGADDR(PDX(a), 0, 0) >= PGROUNDUP(newsz)){
+      // Whole paged-out table goes; no need to read it back.
+      pgtabDrop(myproc(), PDX(a));
+      a = PGADDR(PDX(a) + 1, 0, 0) - PGSIZE;
+      continue;
+    }
     pte = walkpgdir(pgdir, (char*)a, 0);
     if(!pte)
       a = PGADDR(PDX(a) + 1, 0, 0) - PGSIZE;
@@ -406,25 +699,9 @@ deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
         The process itself is deallocating pages via sbrk() with a negative
         argument. Update proc's data structure accordingly.
         */
-
-        for (i = 0; i < MAX_PSYC_PAGES; i++) {
-          if (myproc()->pagesFreedARR[i].virtualAddress == (char*)a)
-            goto UpdateFIFOarr;
-        }
-
-        panic("deallocuvm: entry not found in proc->pagesFreedARR");
-UpdateFIFOarr:
-        myproc()->pagesFreedARR[i].virtualAddress = (char*) 0xffffffff;
-        if (myproc()->head == &myproc()->pagesFreedARR[i])
-          myproc()->head = myproc()->pagesFreedARR[i].next;
-        else {
-          struct emptyPages *l = myproc()->head;
-          while (l->next != &myproc()->pagesFreedARR[i])
-            l = l->next;
-          l->next = myproc()->pagesFreedARR[i].next;
-        }
-        myproc()->pagesFreedARR[i].next = 0;
-        myproc()->pagesInPhyMem--;
+        fifoRemove(myproc(), (char*)a);
+        if (*pte & PTE_PIN)
+          myproc()->pagesPinned--;
       }
       char *v = P2V(pa);
       kfree(v);
@@ -435,38 +712,81 @@ UpdateFIFOarr:
       The process itself is deallocating pages via sbrk() with a negative
       argument. Update proc's data structure accordingly.
       */
-        for (i = 0; i < MAX_PSYC_PAGES; i++) {
-          if (myproc()->pagesSwappedARR[i].virtualAddress == (char*)a)
-            goto UpdateFIFOarrG;
+        // No slot means madvise() already dropped the contents.
+        if ((i = swapSlotFind(myproc(), (char*)a)) >= 0) {
+          myproc()->pagesSwappedARR[i].virtualAddress = (char*) 0xffffffff;
+          myproc()->pagesSwappedARR[i].swaploc = 0;
+          myproc()->pagesInSwapFile--;
         }
-        panic("deallocuvm: entry not found in proc->pagesSwappedARR");
-UpdateFIFOarrG:
-        myproc()->pagesSwappedARR[i].virtualAddress = (char*) 0xffffffff;
-        myproc()->pagesSwappedARR[i].swaploc = 0;
-        myproc()->pagesInSwapFile--;
+        *pte = 0;
     }
 
   }
+
+  // Give back the page tables the shrink emptied.  freevm() frees
+  // a dead process's tables itself once no CPU has them loaded.
+  if (myproc()->pgdir == pgdir) {
+    for (a = PGROUNDUP(newsz); a < oldsz; a = PGADDR(PDX(a) + 1, 0, 0)) {
+      pde_t *pde = &pgdir[PDX(a)];
+      pte_t *pgtab;
+      if ((*pde & (PTE_P|PTE_PS)) != PTE_P)
+        continue;
+      pgtab = (pte_t*)P2V(PTE_ADDR(*pde));
+      for (i = 0; i < NPTENTRIES; i++)
+        if (pgtab[i])
+          break;
+      if (i < NPTENTRIES)
+        continue;
+      *pde = 0;
+      tlbshootdown(pgdir, PGADDR(PDX(a), 0, 0));
+      kfree((char*)pgtab);
+    }
+  }
   return newsz;
 }
 
+// Number of page-table pages backing the user part of pgdir.
+int
+countpgtabs(pde_t *pgdir)
+{
+  int pdx, n;
+
+  n = 0;
+  for (pdx = 0; pdx < PDX(KERNBASE); pdx++)
+    if ((pgdir[pdx] & (PTE_P|PTE_PS)) == PTE_P)
+      n++;
+  return n;
+}
+
 // Free a page table and all the physical memory pages
 // in the user part.
 void
 freevm(pde_t *pgdir)
 {
-  uint i;
+  struct cpu *c;
+  int busy;
 
   if(pgdir == 0)
     panic("freevm: no pgdir");
   deallocuvm(pgdir, KERNBASE, 0);
-  for(i = 0; i < NPDENTRIES; i++){
-    if(pgdir[i] & PTE_P){
-      char * v = P2V(PTE_ADDR(pgdir[i]));
-      kfree(v);
+
+  // Still loaded on another CPU: leave the tables to it.
+  acquire(&lazylock);
+  busy = 0;
+  for(c = cpus; c < cpus+ncpu; c++){
+    if(c->pgdir != pgdir)
+      continue;
+    if(c == mycpu()){
+      lcr3(V2P(kpgdir));
+      c->pgdir = 0;
+    } else {
+      c->pgdirdead = 1;
+      busy = 1;
     }
   }
-  kfree((char*)pgdir);
+  release(&lazylock);
+  if(!busy)
+    freepgtabs(pgdir);
 }
 
 // Clear PTE_U on a page. Used to create an inaccessible
@@ -495,19 +815,23 @@ copyuvm(pde_t *pgdir, uint sz)
   if((d = setupkvm()) == 0)
     return 0;
   for(i = 0; i < sz; i += PGSIZE){
+    // The page table may be paged out and fail to come back.
     if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0)
-      panic("copyuvm: pte should exist");
+      goto bad;
     if(!(*pte & PTE_P) && !(*pte & PTE_PG))
       panic("copyuvm: page not present");
     if (*pte & PTE_PG) {
       cprintf("copyuvm PTR_PG\n"); // TODO delete
-      pte = walkpgdir(d, (void*) i, 1);
+      if((pte = walkpgdir(d, (void*) i, 1)) == 0)
+        goto bad;
       *pte = PTE_U | PTE_W | PTE_PG;
       continue;
     }
     pa = PTE_ADDR(*pte);
-    flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
+    flags = PTE_FLAGS(*pte) & ~PTE_PIN;  // mlock() is not inherited
+    if (flags & PTE_COW)                 // the child's copy is private
+      flags = (flags | PTE_W) & ~PTE_COW;
+    if((mem = allocUserPage(0)) == 0)
       goto bad;
     memmove(mem, (char*)P2V(pa), PGSIZE);
     if(mappages(d, (void*)i, PGSIZE, V2P(mem), flags) < 0) {
@@ -529,7 +853,9 @@ uva2ka(pde_t *pgdir, char *uva)
 {
   pte_t *pte;
 
-  pte = walkpgdir(pgdir, uva, 0);
+  // No PTE if its page table is paged out and could not be read back.
+  if((pte = walkpgdir(pgdir, uva, 0)) == 0)
+    return 0;
   if((*pte & PTE_P) == 0)
     return 0;
   if((*pte & PTE_U) == 0)
@@ -564,22 +890,17 @@ copyout(pde_t *pgdir, uint va, void *p, uint len)
 }
 
 
-void fifoSwap(uint addr){
+int fifoSwap(uint addr){
   int i, j;
   char buffer[BUF_SIZE];
   pte_t *pte1, *pte2;
-  struct emptyPages *l;
-  struct emptyPages *link_temp = myproc()->head;
-  
-  if (link_temp == 0)
-    panic("fifoSwap: proc->head is NULL");
-  if (link_temp->next == 0)
-    panic("fifoSwap: single page in phys mem");
-  // find the before-last link_temp in the used pages list
-  while (link_temp->next->next != 0)
-    link_temp = link_temp->next;
-  l = link_temp->next;
-  link_temp->next = 0;
+  struct emptyPages *l, **pp;
+  uint frame, dst;
+  char *mem;
+
+  if ((pp = fifoVictim(myproc())) == 0)
+    panic("fifoSwap: no unpinned page in phys mem");
+  l = *pp;
 
   if(PRINT_DEBUG){
     cprintf("FIFO chose to page out page starting at 0x%x \n\n", l->virtualAddress);
@@ -589,6 +910,16 @@ void fifoSwap(uint addr){
   pte1 = walkpgdir(myproc()->pgdir, (void*)l->virtualAddress, 0);
   if (!*pte1)
     panic("swapFile: FIFO pte1 is empty");
+  // The victim's frame is reused for the new page, unless KSM shares
+  // it with someone else; then the new page needs a frame of its own.
+  frame = dst = PTE_ADDR(*pte1);
+  if (framerefs(frame) > 1) {
+    if ((mem = kalloc()) == 0)
+      return -1;
+    dst = V2P(mem);
+  }
+  *pp = l->next;
+  l->next = 0;
   //find a swap file page descriptor slot
   for (i = 0; i < MAX_PSYC_PAGES; i++)
     if (myproc()->pagesSwappedARR[i].virtualAddress == (char*)PTE_ADDR(addr))
@@ -602,7 +933,8 @@ SWAPPEDSLOTFOUND:
   if (!*pte2)
     panic("swapFile: FIFO pte2 is empty");
   //set page table entry
-  *pte2 = PTE_ADDR(*pte1) | PTE_U | PTE_W | PTE_P;
+  *pte2 = dst | PTE_U | PTE_W | PTE_P;
+  frameset(dst, myproc()->pgdir, PTE_ADDR(addr));
   for (j = 0; j < 4; j++) {
     int loc = (i * PGSIZE) + ((PGSIZE / 4) * j);
     // cprintf("i:%d j:%d loc:0x%x\n", i,j,loc);//TODO delete
@@ -612,26 +944,642 @@ SWAPPEDSLOTFOUND:
     readFromSwapFile(myproc(), buffer, loc, BUF_SIZE);
     //copy the old page from the memory to the swap file
     //written =
-    writeToSwapFile(myproc(), (char*)(P2V_WO(PTE_ADDR(*pte1)) + addroffset), loc, BUF_SIZE);
+    writeToSwapFile(myproc(), (char*)(P2V_WO(frame) + addroffset), loc, BUF_SIZE);
     //copy the new page from buffer to the memory
     memmove((void*)(PTE_ADDR(addr) + addroffset), (void*)buffer, BUF_SIZE);
   }
   //update the page table entry flags, reset the physical page address
   *pte1 = PTE_U | PTE_W | PTE_PG;
+  tlbshootdown(myproc()->pgdir, (uint)l->virtualAddress);
+  if (dst != frame)
+    kfree(P2V(frame));  // drop our reference to the shared frame
+  pgtabOut(myproc(), PDX(l->virtualAddress));
   //update l to hold the new va
   l->next = myproc()->head;
   myproc()->head = l;
   l->virtualAddress = (char*)PTE_ADDR(addr);
+  return 0;
+}
+
+// Page-table pages are paged out as well once none of their PTEs is
+// present.  A paged-out table lives in one of the MAX_SWAP_PGTABS
+// slots past the data pages in the swap file, and its PDE holds the
+// slot number with PTE_PG set.  It comes back on the next fault or
+// walkpgdir() beneath it.
+
+// Write p's page table for pdx to the swap file and free it, if
+// nothing under it is present.  Returns -1 if it stays resident.
+static int
+pgtabOut(struct proc *p, uint pdx)
+{
+  int slot, i;
+  pte_t *pgtab;
+
+  if ((p->pgdir[pdx] & (PTE_P|PTE_PS)) != PTE_P)
+    return -1;
+  pgtab = (pte_t*)P2V(PTE_ADDR(p->pgdir[pdx]));
+  for (i = 0; i < NPTENTRIES; i++)
+    if (pgtab[i] & PTE_P)
+      return -1;
+  for (slot = 0; slot < MAX_SWAP_PGTABS; slot++)
+    if (p->pgtabSwapped[slot] < 0)
+      break;
+  if (slot == MAX_SWAP_PGTABS)
+    return -1;
+  if (writeToSwapFile(p, (char*)pgtab, (MAX_PSYC_PAGES + slot) * PGSIZE, PGSIZE) != PGSIZE)
+    return -1;
+  p->pgtabSwapped[slot] = pdx;
+  p->pgdir[pdx] = (slot << PTXSHIFT) | PTE_PG;
+  tlbshootdown(p->pgdir, pdx << PDXSHIFT);  // may be loaded lazily
+  kfree((char*)pgtab);
+  return 0;
+}
+
+// Read p's page table for pdx back from the swap file.  Returns -1
+// if no frame could be had.
+static int
+pgtabIn(struct proc *p, uint pdx)
+{
+  int slot;
+  char *mem;
+
+  slot = p->pgdir[pdx] >> PTXSHIFT;
+  if (slot >= MAX_SWAP_PGTABS || p->pgtabSwapped[slot] != pdx)
+    panic("pgtabIn: bad slot");
+  if ((mem = kalloc()) == 0)
+    return -1;
+  frametag(mem, MT_PGTAB);
+  if (readFromSwapFile(p, mem, (MAX_PSYC_PAGES + slot) * PGSIZE, PGSIZE) != PGSIZE) {
+    kfree(mem);
+    return -1;
+  }
+  p->pgdir[pdx] = V2P(mem) | PTE_P | PTE_W | PTE_U;
+  p->pgtabSwapped[slot] = -1;
+  return 0;
+}
+
+// Forget p's paged-out page table for pdx and the swapped pages
+// under it without reading anything back.
+static void
+pgtabDrop(struct proc *p, uint pdx)
+{
+  int i;
+  char *va;
+
+  for (i = 0; i < MAX_PSYC_PAGES; i++) {
+    va = p->pagesSwappedARR[i].virtualAddress;
+    if (va == (char*)0xffffffff || PDX(va) != pdx)
+      continue;
+    p->pagesSwappedARR[i].virtualAddress = (char*)0xffffffff;
+    p->pagesSwappedARR[i].swaploc = 0;
+    p->pagesInSwapFile--;
+  }
+  p->pgtabSwapped[p->pgdir[pdx] >> PTXSHIFT] = -1;
+  p->pgdir[pdx] = 0;
+}
+
+// Page the oldest unpinned resident page of p out to a free swap
+// file slot and release its frame.  Unlike fifoWrite() the list entry is not
+// handed back for reuse, so p ends up with one page less in memory.
+// Returns -1 if p has nothing resident or no free slot.
+static int
+fifoEvict(struct proc *p)
+{
+  int i;
+  struct emptyPages *l, **pp;
+  pte_t *pte;
+  uint pa;
+
+  if ((pp = fifoVictim(p)) == 0 || (i = swapSlotFind(p, (char*)0xffffffff)) < 0)
+    return -1;
+  l = *pp;
+  pte = walkpgdir(p->pgdir, l->virtualAddress, 0);
+  if (pte == 0 || (*pte & PTE_P) == 0)
+    panic("fifoEvict: page not present");
+  if (writeToSwapFile(p, (char*)P2V(PTE_ADDR(*pte)), i * PGSIZE, PGSIZE) != PGSIZE)
+    return -1;
+  *pp = l->next;
+  l->next = 0;
+  p->pagesSwappedARR[i].virtualAddress = l->virtualAddress;
+  pa = PTE_ADDR(*pte);
+  *pte = PTE_W | PTE_U | PTE_PG;
+  tlbshootdown(p->pgdir, (uint)l->virtualAddress);
+  kfree(P2V(pa));
+  pgtabOut(p, PDX(l->virtualAddress));
+  l->virtualAddress = (char*)0xffffffff;
+  p->pagesInPhyMem--;
+  p->pagesInSwapFile++;
+  return 0;
+}
+
+// Read the page at addr back from p's swap file into a new frame,
+// without paging anything else out.  Only valid while p is below
+// MAX_PSYC_PAGES.  Returns -1 if no frame could be had.
+static int
+swapIn(struct proc *p, uint addr)
+{
+  int i;
+  char *mem;
+  pte_t *pte;
+
+  if ((i = swapSlotFind(p, (char*)addr)) < 0)
+    panic("swapIn: page not in swap file");
+  if ((mem = kalloc()) == 0)
+    return -1;
+  if (readFromSwapFile(p, mem, i * PGSIZE, PGSIZE) != PGSIZE) {
+    kfree(mem);
+    return -1;
+  }
+  pte = walkpgdir(p->pgdir, (char*)addr, 0);
+  *pte = V2P(mem) | PTE_W | PTE_U | PTE_P;
+  frameset(V2P(mem), p->pgdir, addr);
+  p->pagesSwappedARR[i].virtualAddress = (char*)0xffffffff;
+  p->pagesSwappedARR[i].swaploc = 0;
+  p->pagesInSwapFile--;
+  fifoRecord(p, (char*)addr);
+  p->pagesInPhyMem++;
+  return 0;
 }
 
-void swapPages(uint addr) {
+// Write out as many of the current process's resident pages as its
+// swap file has room for.  Load control uses this to take a suspended
+// process's frames away.  Returns the number of pages written.
+int
+swapOutAll(void)
+{
   struct proc *proc = myproc();
-  if (strncmp(proc->name, "init",4) == 0 || strncmp(proc->name, "sh", 2) == 0) {
-    proc->pagesInPhyMem++;
-    return;
+  int n;
+
+  for (n = 0; fifoEvict(proc) == 0; n++)
+    ;
+  return n;
+}
+
+// Swap a whole idle process out: its resident pages, then every user
+// page-table page that no longer maps anything present.  The kernel
+// stack stays resident, since the saved context and trap frame point
+// into it.  p must not be running.  Returns the number of frames
+// released.
+int
+swapOutProc(struct proc *p)
+{
+  int n, pdx, i;
+
+  for (n = 0; p->head != 0; n++) {
+    i = swapSlotFind(p, (char*)0xffffffff);
+    if (fifoEvict(p) < 0)
+      break;
+    p->pagesSwappedARR[i].swaploc = 1;  // bring back with the process
+  }
+  for (pdx = 0; pdx < PDX(KERNBASE); pdx++)
+    if (pgtabOut(p, pdx) == 0)
+      n++;
+  return n;
+}
+
+// Undo swapOutProc(): read the page-table pages back, then the pages
+// that were resident when the process went out.  Pages that do not
+// fit fault back in later.  Returns -1 if a page table could not be
+// restored, in which case p must stay swapped out.
+int
+swapInProc(struct proc *p)
+{
+  int slot, i;
+
+  for (slot = 0; slot < MAX_SWAP_PGTABS; slot++)
+    if (p->pgtabSwapped[slot] >= 0 && pgtabIn(p, p->pgtabSwapped[slot]) < 0)
+      return -1;
+  for (i = 0; i < MAX_PSYC_PAGES; i++) {
+    if (p->pagesSwappedARR[i].swaploc == 0)
+      continue;
+    p->pagesSwappedARR[i].swaploc = 0;
+    if (p->pagesInPhyMem < MAX_PSYC_PAGES)
+      swapIn(p, (uint)p->pagesSwappedARR[i].virtualAddress);
+  }
+  return 0;
+}
+
+// Map a fresh zeroed page at addr, whose old contents madvise()
+// threw away.  Returns -1 if no frame or swap slot could be had.
+static int
+zeroFill(struct proc *p, uint addr)
+{
+  char *mem;
+  pte_t *pte;
+
+  if (p->pagesInPhyMem >= MAX_PSYC_PAGES && fifoEvict(p) < 0)
+    return -1;
+  if ((mem = allocUserPage(1)) == 0)
+    return -1;
+  pte = walkpgdir(p->pgdir, (char*)addr, 0);
+  *pte = V2P(mem) | (*pte & (PTE_W|PTE_U)) | PTE_P;
+  frameset(V2P(mem), p->pgdir, addr);
+  fifoRecord(p, (char*)addr);
+  p->pagesInPhyMem++;
+  return 0;
+}
+
+// The advice in effect for addr, from p's madvise() ranges.
+static int
+madvAt(struct proc *p, uint addr)
+{
+  int i;
+
+  for (i = 0; i < MAX_MADVISE; i++)
+    if (p->madv[i].start <= addr && addr < p->madv[i].end)
+      return p->madv[i].advice;
+  return MADV_NORMAL;
+}
+
+// Fault in addr's page from swap, then apply any MADV_SEQUENTIAL
+// advice: the page behind becomes the next to be evicted, and the
+// next MADV_READAHEAD swapped-out pages are read in ahead of use.
+// Returns -1 if no frame or swap slot could be had.
+static int
+swapFault(struct proc *p, uint addr)
+{
+  uint a;
+  pte_t *pte;
+
+  if (swapSlotFind(p, (char*)addr) < 0)
+    return zeroFill(p, addr);
+  // Below the resident limit (e.g. after load control swapped the
+  // process out) just read the page back; otherwise trade places
+  // with the oldest resident page.
+  if ((p->pagesInPhyMem >= MAX_PSYC_PAGES || swapIn(p, addr) < 0) &&
+      fifoSwap(addr) < 0)
+    return -1;
+
+  if (madvAt(p, addr) != MADV_SEQUENTIAL)
+    return 0;
+  if (addr >= PGSIZE && madvAt(p, addr - PGSIZE) == MADV_SEQUENTIAL)
+    fifoDemote(p, (char*)(addr - PGSIZE));
+  for (a = addr + PGSIZE; a < addr + (MADV_READAHEAD + 1) * PGSIZE && a < p->sz; a += PGSIZE) {
+    if (madvAt(p, a) != MADV_SEQUENTIAL)
+      break;
+    pte = walkpgdir(p->pgdir, (char*)a, 0);
+    if (pte == 0 || (*pte & PTE_PG) == 0 || swapSlotFind(p, (char*)a) < 0)
+      continue;
+    if (p->pagesInPhyMem >= MAX_PSYC_PAGES && fifoEvict(p) < 0)
+      break;
+    if (swapIn(p, a) < 0)
+      break;
+  }
+  return 0;
+}
+
+// Record access-pattern advice for [start, end), replacing whatever
+// advice overlapped it.  MADV_NORMAL just clears.
+static int
+madvRecord(struct proc *p, uint start, uint end, int advice)
+{
+  int i, slot;
+
+  slot = -1;
+  for (i = 0; i < MAX_MADVISE; i++) {
+    if (p->madv[i].start < end && start < p->madv[i].end)
+      p->madv[i].start = p->madv[i].end = 0;
+    if (p->madv[i].start == p->madv[i].end && slot < 0)
+      slot = i;
+  }
+  if (advice == MADV_NORMAL)
+    return 0;
+  if (slot < 0)
+    return -1;
+  p->madv[slot].start = start;
+  p->madv[slot].end = end;
+  p->madv[slot].advice = advice;
+  return 0;
+}
+
+// Pin [addr, addr+len) of the current process in memory, faulting
+// in whatever is swapped out, so replacement never picks it.  At
+// most MAX_PINNED_PAGES pages may be pinned, which leaves FIFO
+// something to evict.  If a page cannot be had, or the range runs
+// into the guard page, the pages pinned so far are unpinned again.
+int
+mlock(uint addr, uint len)
+{
+  struct proc *p = myproc();
+  uint a, end, mine;
+  pte_t *pte;
+  int n;
+
+  end = PGROUNDUP(addr + len);
+  addr = PGROUNDDOWN(addr);
+  if (end < addr || end > p->sz)
+    return -1;
+  n = 0;
+  for (a = addr; a < end; a += PGSIZE)
+    if ((pte = walkpgdir(p->pgdir, (char*)a, 0)) == 0 || (*pte & PTE_PIN) == 0)
+      n++;
+  if (p->pagesPinned + n > MAX_PINNED_PAGES)
+    return -1;
+
+  // Bit i of mine: this call pinned page i of the range, which the
+  // limit keeps under 32 pages long.
+  mine = 0;
+  for (a = addr; a < end; a += PGSIZE) {
+    if ((p->pgdir[PDX(a)] & (PTE_P|PTE_PG)) == PTE_PG && pgtabIn(p, PDX(a)) < 0)
+      goto undo;
+    pte = walkpgdir(p->pgdir, (char*)a, 0);
+    if (pte == 0 || (*pte & (PTE_P|PTE_PG)) == 0 || (*pte & PTE_U) == 0)
+      goto undo;
+    if ((*pte & PTE_P) == 0 && swapFault(p, a) < 0)
+      goto undo;
+    if ((*pte & PTE_PIN) == 0) {
+      *pte |= PTE_PIN;
+      p->pagesPinned++;
+      mine |= 1 << ((a - addr) / PGSIZE);
+    }
+  }
+  return 0;
+
+undo:
+  for (a = addr; a < end; a += PGSIZE) {
+    if (mine & (1 << ((a - addr) / PGSIZE))) {
+      *walkpgdir(p->pgdir, (char*)a, 0) &= ~PTE_PIN;
+      p->pagesPinned--;
+    }
+  }
+  return -1;
+}
+
+// Undo mlock() for [addr, addr+len).
+int
+munlock(uint addr, uint len)
+{
+  struct proc *p = myproc();
+  uint a, end;
+  pte_t *pte;
+
+  end = PGROUNDUP(addr + len);
+  addr = PGROUNDDOWN(addr);
+  if (end < addr || end > p->sz)
+    return -1;
+  for (a = addr; a < end; a += PGSIZE) {
+    pte = walkpgdir(p->pgdir, (char*)a, 0);
+    if (pte && (*pte & PTE_PIN)) {
+      *pte &= ~PTE_PIN;
+      p->pagesPinned--;
+    }
+  }
+  return 0;
+}
+
+// madvise() for the current process.  addr must be page aligned and
+// [addr, addr+len) inside the process.
+//   MADV_WILLNEED   read swapped-out pages in while there is room
+//   MADV_DONTNEED,
+//   MADV_FREE       discard pages and swap slots without writing
+//                   anything; the next touch gets a zeroed page.
+//                   Pinned pages are left alone; a range with
+//                   the guard page in it fails.
+//   MADV_SEQUENTIAL evict behind and read ahead of faults in the range
+//   MADV_RANDOM,
+//   MADV_NORMAL     no readahead (the default)
+int
+madvise(uint addr, uint len, int advice)
+{
+  struct proc *p = myproc();
+  uint a, end, pa, flags;
+  pte_t *pte;
+  int i;
+
+  end = PGROUNDUP(addr + len);
+  if (addr % PGSIZE || end < addr || end > p->sz)
+    return -1;
+
+  switch (advice) {
+  case MADV_NORMAL:
+  case MADV_RANDOM:
+  case MADV_SEQUENTIAL:
+    return madvRecord(p, addr, end, advice);
+
+  case MADV_WILLNEED:
+    for (a = addr; a < end && p->pagesInPhyMem < MAX_PSYC_PAGES; a += PGSIZE) {
+      pte = walkpgdir(p->pgdir, (char*)a, 0);
+      if (pte && (*pte & PTE_PG) && swapSlotFind(p, (char*)a) >= 0 && swapIn(p, a) < 0)
+        break;
+    }
+    break;
+
+  case MADV_DONTNEED:
+  case MADV_FREE:
+    for (a = addr; a < end; a += PGSIZE) {
+      pte = walkpgdir(p->pgdir, (char*)a, 0);
+      if (pte && (*pte & (PTE_P|PTE_PG)) && !(*pte & PTE_U))
+        return -1;
+    }
+    for (a = addr; a < end; a += PGSIZE) {
+      if ((pte = walkpgdir(p->pgdir, (char*)a, 0)) == 0 || (*pte & PTE_PIN))
+        continue;
+      // A copy-on-write page was writable; the zeroed one is its own.
+      flags = PTE_U | PTE_PG;
+      if (*pte & (PTE_W|PTE_COW))
+        flags |= PTE_W;
+      if (*pte & PTE_P) {
+        pa = PTE_ADDR(*pte);
+        fifoRemove(p, (char*)a);
+        *pte = flags;
+        tlbshootdown(p->pgdir, a);
+        kfree(P2V(pa));
+        continue;
+      } else if ((*pte & PTE_PG) && (i = swapSlotFind(p, (char*)a)) >= 0) {
+        p->pagesSwappedARR[i].virtualAddress = (char*)0xffffffff;
+        p->pagesSwappedARR[i].swaploc = 0;
+        p->pagesInSwapFile--;
+      } else
+        continue;
+      *pte = flags;
+    }
+    break;
+
+  default:
+    return -1;
+  }
+  return 0;
+}
+
+// Give the page at va in pgdir, merged by KSM, back a writable frame
+// of its own: a copy if the frame is still shared, otherwise the
+// frame itself.  Returns -1 if va is not copy-on-write or no frame
+// could be had.
+static int
+cowBreak(pde_t *pgdir, uint va)
+{
+  pte_t *pte;
+  uint pa, flags;
+  char *mem;
+
+  pte = walkpgdir(pgdir, (char*)va, 0);
+  if (pte == 0 || (*pte & (PTE_P|PTE_COW)) != (PTE_P|PTE_COW))
+    return -1;
+  pa = PTE_ADDR(*pte);
+  flags = (PTE_FLAGS(*pte) | PTE_W) & ~PTE_COW;
+  if (framerefs(pa) == 1) {
+    *pte = pa | flags;
+    frameset(pa, pgdir, va);
+    tlbshootdown(pgdir, va);
+    return 0;
+  }
+  // No allocUserPage(): this can run in the kernel under a spinlock.
+  if ((mem = kalloc()) == 0)
+    return -1;
+  memmove(mem, P2V(pa), PGSIZE);
+  *pte = V2P(mem) | flags;
+  frameset(V2P(mem), pgdir, va);
+  tlbshootdown(pgdir, va);
+  kfree(P2V(pa));
+  return 0;
+}
+
+// Page fault on addr in the current process, from user code or from
+// the kernel copying to or from user memory: read a paged-out page
+// table or page back in, or copy a merged page on a write.  Returns
+// -1 if the fault is none of those.  If the page cannot be had, the
+// process is killed and 0 returned; trap() makes it exit if the fault
+// came from user space, and a copy in the kernel faults again until
+// memory turns up.  System calls check their buffers with
+// uvmresident() first, so only a page evicted again during the copy
+// gets that far.
+int
+pageFault(uint addr, int write)
+{
+  struct proc *p = myproc();
+  pde_t *pde;
+  pte_t *pte;
+  int r;
+
+  pde = &p->pgdir[PDX(addr)];
+  if ((*pde & (PTE_P|PTE_PG)) == PTE_PG) {  // page table is in the swap file
+    if (pgtabIn(p, PDX(addr)) < 0)
+      goto nomem;
+  }
+  if ((*pde & PTE_P) == 0)
+    return -1;
+  pte = (pte_t*)P2V(PTE_ADDR(*pde)) + PTX(addr);
+  if (write && (*pte & (PTE_P|PTE_COW)) == (PTE_P|PTE_COW))
+    r = cowBreak(p->pgdir, PGROUNDDOWN(addr));
+  else if ((*pte & (PTE_P|PTE_PG)) == PTE_PG) {
+    loadctlfault();
+    r = swapFault(p, PGROUNDDOWN(addr));
+  } else
+    return -1;
+  if (r == 0)
+    return 0;
+nomem:
+  if (!p->killed)
+    cprintf("pid %d %s: no memory for page 0x%x\n", p->pid, p->name, addr);
+  p->killed = 1;
+  return 0;
+}
+
+// Read the paged-out pages of [addr, addr+n) in the current process
+// back in before the kernel copies to or from them.  Returns -1 if
+// one of them cannot be had, which fails the system call instead of
+// the copy.
+int
+uvmresident(uint addr, uint n)
+{
+  struct proc *p = myproc();
+  uint a;
+  pte_t *pte;
+
+  for (a = PGROUNDDOWN(addr); a < addr + n; a += PGSIZE) {
+    if ((p->pgdir[PDX(a)] & (PTE_P|PTE_PG)) == PTE_PG &&
+        pgtabIn(p, PDX(a)) < 0)
+      return -1;
+    pte = walkpgdir(p->pgdir, (char*)a, 0);
+    if (pte && (*pte & (PTE_P|PTE_PG)) == PTE_PG) {
+      loadctlfault();
+      if (swapFault(p, a) < 0)
+        return -1;
+    }
+  }
+  return 0;
+}
+
+// Kernel same-page merging.  kswapd hashes the resident pages of
+// processes that are not running and maps byte-identical ones onto
+// one frame, read-only and marked PTE_COW; pageFault() copies it again
+// on a write.  ksm[] remembers one page per hash bucket from earlier
+// scans, checked against the page tables before it is trusted.
+#define KSM_SLOTS 128
+
+static struct ksmSlot {
+  uint hash;                   // ksmHash() of the page
+  uint pa;                     // its frame
+  struct proc *p;              // where it was seen
+  uint va;
+} ksm[KSM_SLOTS];
+
+// May p's pages be merged?  Only if p cannot touch them meanwhile:
+// not while it is asleep in swap file I/O, holding a pointer to one
+// of its frames.
+static int
+ksmOk(struct proc *p)
+{
+  return (p->state == SLEEPING || p->state == RUNNABLE) &&
+         p->pgdir != 0 && !p->swappedout && !p->killed && !p->pagingio;
+}
+
+static uint
+ksmHash(char *v)
+{
+  uint h, *w;
+
+  h = 2166136261;
+  for (w = (uint*)v; w < (uint*)(v + PGSIZE); w++)
+    h = (h ^ *w) * 16777619;
+  return h;
+}
+
+// Merge p's resident pages with identical pages seen before, hashing
+// at most budget of them.  Returns the number hashed.  The caller
+// holds ptable.lock, so that nobody starts running while their page
+// tables change.
+int
+ksmScan(struct proc *p, int budget)
+{
+  struct emptyPages *l;
+  struct ksmSlot *s;
+  pte_t *pte, *kpte;
+  uint va, pa, h;
+  int n;
+
+  if (!ksmOk(p))
+    return 0;
+  n = 0;
+  for (l = p->head; l != 0 && n < budget; l = l->next) {
+    va = (uint)l->virtualAddress;
+    pte = walkpgdir(p->pgdir, (char*)va, 0);
+    if (pte == 0 || (*pte & PTE_P) == 0 || (*pte & PTE_PIN))
+      continue;
+    pa = PTE_ADDR(*pte);
+    h = ksmHash(P2V(pa));
+    n++;
+    s = &ksm[h % KSM_SLOTS];
+    if (s->p && s->hash == h && s->pa != pa && ksmOk(s->p) &&
+        (kpte = walkpgdir(s->p->pgdir, (char*)s->va, 0)) != 0 &&
+        (*kpte & (PTE_P|PTE_PIN)) == PTE_P && PTE_ADDR(*kpte) == s->pa &&
+        memcmp(P2V(s->pa), P2V(pa), PGSIZE) == 0) {
+      if ((*kpte & PTE_COW) == 0) {
+        *kpte = (*kpte & ~PTE_W) | PTE_COW;
+        tlbshootdown(s->p->pgdir, s->va);
+      }
+      frameref(s->pa);
+      *pte = s->pa | ((PTE_FLAGS(*pte) & ~PTE_W) | PTE_COW);
+      tlbshootdown(p->pgdir, va);
+      kfree(P2V(pa));
+      continue;
+    }
+    s->hash = h;
+    s->pa = pa;
+    s->p = p;
+    s->va = va;
   }
-  fifoSwap(addr);
-  lcr3(V2P(proc->pgdir));
+  return n;
 }
 
 //PAGEBREAK!